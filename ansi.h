@@ -34,7 +34,15 @@ public:
 		KEY_RIGHT,
 		KEY_LEFT,
 
+		KEY_SEARCH_BACK,	// Ctrl + R - поиск по истории
+		KEY_SEARCH_FORWARD,	// Ctrl + S
+		KEY_CANCEL,			// Ctrl + G
+
+		PASTE_BEGIN,		// ESC[200~ - начало вставленного текста
+		PASTE_END,			// ESC[201~
+
 		ERASE_DISPLAY,
+		BRACKETED_PASTE,	// Включение (1) / выключение (0) обрамления вставки
 
 		STYLE
 	} TCode;
@@ -86,6 +94,12 @@ public:
 
 		if (esc.pos == 0)
 		{
+			// Текст - без разбора; управляющий символ без собственного кода - NONE
+			if (!IsControl(c)) {
+				resetDecoder();
+				return NONE;
+			}
+
 			switch (c) {
 				case '\010':		// Ctrl + Backspace
 					return KEY_BACKSPACE;
@@ -93,6 +107,15 @@ public:
 				case '\011':		// Tab
 					return KEY_TAB;
 
+				case '\022':		// Ctrl + R
+					return KEY_SEARCH_BACK;
+
+				case '\023':		// Ctrl + S
+					return KEY_SEARCH_FORWARD;
+
+				case '\007':		// Ctrl + G
+					return KEY_CANCEL;
+
 				case '\0':		// \0
 					return KEY_END_LINE;
 
@@ -190,6 +213,29 @@ public:
 
 	}
 
+	// Декодируется ESC последовательность
+	bool Pending() const {
+		return esc.pos > 0;
+	}
+
+	// Управляющий символ C0 или DEL: только такие символы Decode сопоставляет клавишам
+	static bool IsControl(char c) {
+		return ((uint8_t)c < 0x20) || (c == '\177');
+	}
+
+	/**
+	 * Длина начального участка p без управляющих символов (IsControl):
+	 * вне ESC последовательности он декодируется посимвольно как NONE.
+	 */
+	static size_t TextLen(const char *p, size_t len) {
+		size_t n = 0;
+
+		while ((n < len) && !IsControl(p[n]))
+			n++;
+
+		return n;
+	}
+
 	short GetNum(int n) {
 		if ((n < 0) || (n > MAX_NUMS))
 			return 0;
@@ -208,6 +254,10 @@ public:
 				sprintf(s, "\033[3J\033[0;0H\033[0J");
 				break;
 
+			case BRACKETED_PASTE:
+				sprintf(s, va_arg(args, int) ? "\033[?2004h" : "\033[?2004l");
+				break;
+
 			case STYLE:
 				sprintf(s, "\033[");
 				while (1) {
@@ -240,6 +290,12 @@ private:
 			case 3:
 				return KEY_DEL;
 
+			case 200:
+				return PASTE_BEGIN;
+
+			case 201:
+				return PASTE_END;
+
 			default:
 				return NONE;
 		}
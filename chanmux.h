@@ -0,0 +1,597 @@
+#ifndef __CHANNEL_MUX_H__
+#define __CHANNEL_MUX_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "paralstream.h"
+#include "clock.h"
+
+
+/**
+ * Мультиплексирование нескольких логических каналов в одном потоке.
+ *
+ * Каждый канал - самостоятельный ParallelStream (консоль, журнал, передача файлов).
+ *
+ * Кадр: FLAG | заголовок | значение (2 байта, LE) | данные | CRC-8 | FLAG,
+ * байты FLAG и ESC внутри кадра экранируются (ESC, байт ^ 0x20).
+ * Заголовок: тип кадра (старшие 4 бита) + номер канала (младшие 4 бита).
+ *
+ * Управление потоком - кредитами: получатель объявляет границу окна
+ * (принято байт + свободное место в буфере канала), отправитель не передаёт
+ * данные за её пределы. Кадр данных содержит смещение своего первого байта,
+ * поэтому потерянный кадр не уменьшает окно, а учитывается как потеря.
+ *
+ * Очередность передачи определяется приоритетом канала, при равных приоритетах
+ * каналы обслуживаются по очереди. Кадры не длиннее MAX_PAYLOAD, поэтому
+ * передача файла не задерживает консоль дольше одного кадра.
+ *
+ * Обмен с нижним потоком выполняется во время вызовов методов каналов и Poll,
+ * отдельный поток выполнения не требуется. Не потокобезопасен.
+ * Таймауты и интервалы отсчитываются по часам clock.
+ *
+ * @tparam CHANNELS  Количество каналов (не более 16)
+ * @tparam BUFF_SIZE Размер буферов приёма и передачи каждого канала, байт
+ */
+template <size_t CHANNELS, size_t BUFF_SIZE = 256>
+class ChannelMux {
+	static_assert((CHANNELS > 0) && (CHANNELS <= 16), "ChannelMux supports 1..16 channels");
+	static_assert((BUFF_SIZE >= 16) && (BUFF_SIZE <= 0x4000), "ChannelMux buffer size out of range");
+
+public:
+	static const size_t MAX_PAYLOAD = 64;
+	static const size_t POLL_MS = 10;
+	static const size_t WRITE_TIMEOUT_MS = 1000;
+	static const size_t PROBE_MS = 100;			// Запрос кредита при остановленной передаче
+
+	static const uint8_t FLAG = 0x7E;
+	static const uint8_t ESC = 0x7D;
+	static const uint8_t ESC_XOR = 0x20;
+
+	typedef enum {
+		FRAME_DATA = 0,			// Значение - смещение первого байта данных
+		FRAME_CREDIT = 1,		// Значение - граница окна приёма
+		FRAME_RESET = 2,		// Сброс состояния всех каналов (перезапуск стороны)
+	} TFrame;
+
+	typedef struct {
+		uint64_t txFrames;
+		uint64_t rxFrames;
+		uint64_t rxErrors;		// Кадры с ошибкой CRC или формата
+		uint64_t rxLost;		// Байт данных в потерянных кадрах
+		uint64_t rxOverruns;	// Байт, не поместившихся в буфер (нарушение окна)
+	} Stats_t;
+
+	class Channel : public ParallelStream {
+	public:
+		int Write(const char *p, size_t len) final {
+			return mux->write(n, p, len);
+		}
+
+		int WriteByte(char c) final {
+			return Write(&c, 1);
+		}
+
+		int ReadByte(char *c, size_t timeoutMs) final {
+			return Read(c, 1, timeoutMs);
+		}
+
+		int Read(char *p, size_t len, size_t timeoutMs) final {
+			return mux->read(n, p, len, timeoutMs);
+		}
+
+		int Flush() final {
+			return mux->flush();
+		}
+
+		int Drain() final {
+			return mux->drain(n);
+		}
+
+		// Ожидание места в буфере передачи канала (по умолчанию WRITE_TIMEOUT_MS)
+		size_t SetWriteTimeout(size_t timeoutMs) final {
+			size_t prev = mux->chan[n].writeTimeoutMs;
+
+			mux->chan[n].writeTimeoutMs = timeoutMs;
+			return prev;
+		}
+
+	private:
+		friend class ChannelMux;
+
+		ChannelMux *mux;
+		size_t n;
+	};
+
+public:
+	ChannelMux(ParallelStream &a_link, Clock &a_clock = MonotonicClock::Instance())
+	:
+	link(a_link),
+	clock(a_clock)
+	{
+		for (size_t i = 0; i < CHANNELS; i++) {
+			chan[i].stream.mux = this;
+			chan[i].stream.n = i;
+			chan[i].prio = 0;
+			chan[i].writeTimeoutMs = WRITE_TIMEOUT_MS;
+		}
+
+		for (size_t i = 0; i < CHANNELS; i++) {
+			chan[i].txHead = chan[i].txCount = 0;
+			chan[i].txTotal = 0;
+			chan[i].peerLimit = BUFF_SIZE;
+			chan[i].probePending = false;
+			resetRx(chan[i]);
+		}
+
+		stats = {0, 0, 0, 0, 0};
+		rr = 0;
+		lastRxMs = clock.NowMs();
+		parse.len = 0;
+		parse.esc = false;
+
+		// Сброс состояния противоположной стороны
+		sendFrame(FRAME_RESET, 0, 0, nullptr, 0);
+	}
+
+	Channel & operator[](size_t n) {
+		return chan[n].stream;
+	}
+
+	/**
+	 * Приоритет канала: данные каналов с большим значением передаются первыми.
+	 */
+	void SetPriority(size_t n, uint8_t prio) {
+		chan[n].prio = prio;
+	}
+
+	/**
+	 * Обмен с нижним потоком: передача ожидающих кадров и приём
+	 * с ожиданием не дольше timeoutMs.
+	 *
+	 * @return 0 или отрицательный код ошибки
+	 */
+	int Poll(size_t timeoutMs) {
+		int res;
+
+		if ((res = flush()) < 0)
+			return res;
+		if ((res = pumpRx(timeoutMs)) < 0)
+			return res;
+		if (res == 0)
+			Idle();
+		return flush();
+	}
+
+	/**
+	 * Проверка времени без приёма, если ожидание выполняется вне Poll.
+	 * Окно, закрытое дольше PROBE_MS, запрашивается повторно:
+	 * объявление кредита могло быть потеряно.
+	 */
+	void Idle() {
+		uint64_t now = clock.NowMs();
+
+		if (now - lastRxMs < PROBE_MS)
+			return;
+
+		lastRxMs = now;
+		for (size_t i = 0; i < CHANNELS; i++)
+			if ((chan[i].txCount > 0) && (txWindow(chan[i]) == 0))
+				chan[i].probePending = true;
+	}
+
+	// Место в буфере передачи канала - запись такого объёма не ожидает
+	size_t TxFree(size_t n) const {
+		return BUFF_SIZE - chan[n].txCount;
+	}
+
+	// Байты канала, ожидающие передачи
+	size_t TxCount(size_t n) const {
+		return chan[n].txCount;
+	}
+
+	// Принятые, но не прочитанные байты канала
+	size_t RxCount(size_t n) const {
+		return chan[n].rxCount;
+	}
+
+	const Stats_t & Stats() const {
+		return stats;
+	}
+
+private:
+	typedef struct {
+		Channel stream;
+		uint8_t prio;
+		size_t writeTimeoutMs;
+
+		char rxBuff[BUFF_SIZE];
+		size_t rxHead;
+		size_t rxCount;
+		uint16_t rxTotal;		// Смещение следующего ожидаемого байта
+		uint16_t rxAdvertised;	// Последняя объявленная граница окна
+		bool rxSynced;			// Принят кадр данных после сброса
+		bool creditPending;
+
+		char txBuff[BUFF_SIZE];
+		size_t txHead;
+		size_t txCount;
+		uint16_t txTotal;		// Смещение следующего передаваемого байта
+		uint16_t peerLimit;		// Граница окна получателя
+		bool probePending;		// Запрос объявления окна
+	} Chan_t;
+
+	// Заголовок + значение + данные + CRC
+	static const size_t FRAME_MAX = 1 + 2 + MAX_PAYLOAD + 1;
+
+private:
+	static uint8_t crc8(uint8_t crc, uint8_t b) {
+		crc ^= b;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+		return crc;
+	}
+
+	// Приём с начала: противоположная сторона (пере)запущена
+	void resetRx(Chan_t &c) {
+		c.rxHead = c.rxCount = 0;
+		c.rxTotal = 0;
+		c.rxSynced = false;
+		c.rxAdvertised = BUFF_SIZE;
+		c.creditPending = false;
+	}
+
+	// Граница окна приёма канала
+	uint16_t rxLimit(const Chan_t &c) const {
+		return c.rxTotal + (BUFF_SIZE - c.rxCount);
+	}
+
+	// Объём данных, который получатель готов принять
+	size_t txWindow(const Chan_t &c) const {
+		uint16_t w = c.peerLimit - c.txTotal;
+		return (w < 0x8000) ? w : 0;
+	}
+
+	// Кадр из заголовка, значения и данных из кольцевого буфера (src[pos..] с переходом через конец)
+	int sendFrame(uint8_t type, size_t n, uint16_t value, const char *src, size_t len, size_t pos = 0) {
+		uint8_t out[2 + FRAME_MAX * 2];
+		size_t o = 0;
+		uint8_t crc = 0;
+		int res;
+
+		auto put = [&](uint8_t v) {
+			crc = crc8(crc, v);
+			if ((v == FLAG) || (v == ESC)) {
+				out[o++] = ESC;
+				out[o++] = v ^ ESC_XOR;
+			}
+			else
+				out[o++] = v;
+		};
+
+		out[o++] = FLAG;
+		put((uint8_t)((type << 4) | n));
+		put((uint8_t)value);
+		put((uint8_t)(value >> 8));
+
+		for (size_t i = 0; i < len; i++)
+			put((uint8_t)src[(pos + i) % BUFF_SIZE]);
+
+		put(crc);
+		out[o++] = FLAG;
+
+		for (size_t done = 0; done < o; done += res) {
+			res = link.Write((const char *)&out[done], o - done);
+			if (res == -EAGAIN)
+				res = 0;
+			else if (res <= 0)
+				return (res < 0) ? res : -EIO;
+		}
+
+		stats.txFrames++;
+		return 0;
+	}
+
+	// Передача объявлений кредита и данных каналов в порядке приоритета
+	int pumpTx() {
+		Chan_t *best;
+		size_t len;
+		int res;
+
+		for (size_t i = 0; i < CHANNELS; i++) {
+			Chan_t &c = chan[i];
+
+			if (c.creditPending) {
+				c.rxAdvertised = rxLimit(c);
+				c.creditPending = false;
+
+				if ((res = sendFrame(FRAME_CREDIT, i, c.rxAdvertised, nullptr, 0)) < 0)
+					return res;
+			}
+
+			if (c.probePending) {
+				c.probePending = false;
+
+				if ((res = sendFrame(FRAME_DATA, i, c.txTotal, nullptr, 0)) < 0)
+					return res;
+			}
+		}
+
+		while (1) {
+			best = nullptr;
+
+			for (size_t k = 0; k < CHANNELS; k++) {
+				Chan_t &c = chan[(rr + k) % CHANNELS];
+
+				if ((c.txCount > 0) && (txWindow(c) > 0) && ((best == nullptr) || (c.prio > best->prio)))
+					best = &c;
+			}
+
+			if (best == nullptr)
+				return 0;
+
+			len = best->txCount;
+			if (len > txWindow(*best))
+				len = txWindow(*best);
+			if (len > MAX_PAYLOAD)
+				len = MAX_PAYLOAD;
+
+			res = sendFrame(FRAME_DATA, best->stream.n, best->txTotal, best->txBuff, len, best->txHead);
+			if (res < 0)
+				return res;
+
+			best->txHead = (best->txHead + len) % BUFF_SIZE;
+			best->txCount -= len;
+			best->txTotal += len;
+
+			rr = (best->stream.n + 1) % CHANNELS;
+		}
+	}
+
+	int flush() {
+		int res = pumpTx();
+		return (res < 0) ? res : link.Flush();
+	}
+
+	// Приём из нижнего потока и разбор кадров
+	int pumpRx(size_t timeoutMs) {
+		char buff[MAX_PAYLOAD];
+		uint64_t start;
+		uint8_t b;
+		int res;
+
+		start = (timeoutMs > 0) ? clock.NowNs() : 0;
+		res = link.Read(buff, sizeof(buff), timeoutMs);
+
+		if ((res == 0) && (timeoutMs > 0))
+			clock.WaitUntilNs(start + timeoutMs * 1000000ull);
+		if (res <= 0)
+			return res;
+
+		lastRxMs = clock.NowMs();
+
+		for (int i = 0; i < res; i++) {
+			b = (uint8_t)buff[i];
+
+			if (b == FLAG) {
+				if (parse.len > 0)
+					handleFrame();
+				parse.len = 0;
+				parse.esc = false;
+				continue;
+			}
+
+			if (b == ESC) {
+				parse.esc = true;
+				continue;
+			}
+
+			if (parse.esc) {
+				b ^= ESC_XOR;
+				parse.esc = false;
+			}
+
+			// Слишком длинный кадр - отбрасывается до следующего FLAG
+			if (parse.len == FRAME_MAX) {
+				stats.rxErrors++;
+				parse.len = FRAME_MAX + 1;
+			}
+			if (parse.len < FRAME_MAX)
+				parse.buff[parse.len++] = b;
+		}
+
+		return res;
+	}
+
+	void handleFrame() {
+		uint8_t crc = 0;
+		uint8_t type;
+		size_t n;
+		uint16_t value;
+		const char *data;
+		size_t len;
+		uint16_t gap;
+
+		if (parse.len > FRAME_MAX)
+			return;
+
+		for (size_t i = 0; i < parse.len; i++)
+			crc = crc8(crc, parse.buff[i]);
+
+		if ((parse.len < 4) || (crc != 0)) {
+			stats.rxErrors++;
+			return;
+		}
+
+		type = parse.buff[0] >> 4;
+		n = parse.buff[0] & 0x0F;
+		value = parse.buff[1] | (parse.buff[2] << 8);
+		data = (const char *)&parse.buff[3];
+		len = parse.len - 4;
+
+		// Противоположная сторона перезапущена. Смещения передачи не сбрасываются:
+		// получатель примет их с первым кадром. Окно закрывается до его объявления
+		// в ответ на запрос - часть уже переданных данных может быть в буфере получателя.
+		if (type == FRAME_RESET) {
+			stats.rxFrames++;
+			for (size_t i = 0; i < CHANNELS; i++) {
+				resetRx(chan[i]);
+				chan[i].peerLimit = chan[i].txTotal;
+				chan[i].probePending = true;
+			}
+			return;
+		}
+
+		if (n >= CHANNELS) {
+			stats.rxErrors++;
+			return;
+		}
+
+		Chan_t &c = chan[n];
+		stats.rxFrames++;
+
+		switch (type) {
+			case FRAME_CREDIT:
+				// Устаревшие объявления игнорируются
+				if ((uint16_t)(value - c.peerLimit) < 0x8000)
+					c.peerLimit = value;
+				break;
+
+			case FRAME_DATA:
+				// Первый кадр после сброса задаёт начальное смещение,
+				// отправитель ожидает объявления окна
+				if (!c.rxSynced) {
+					c.rxSynced = true;
+					c.rxTotal = value;
+					c.creditPending = true;
+				}
+
+				// Пустой кадр - запрос кредита
+				if (len == 0) {
+					c.creditPending = true;
+					break;
+				}
+
+				gap = value - c.rxTotal;
+				if (gap >= 0x8000)
+					break;		// Повтор уже принятых данных
+
+				stats.rxLost += gap;
+				c.rxTotal = value;
+
+				for (size_t i = 0; i < len; i++) {
+					if (c.rxCount == BUFF_SIZE) {
+						stats.rxOverruns += len - i;
+						break;
+					}
+					c.rxBuff[(c.rxHead + c.rxCount) % BUFF_SIZE] = data[i];
+					c.rxCount++;
+				}
+
+				c.rxTotal += len;
+
+				// Пропуск данных сдвигает окно - объявление без ожидания чтения
+				if (gap > 0)
+					c.creditPending = true;
+				break;
+
+			default:
+				stats.rxErrors++;
+				break;
+		}
+	}
+
+	int write(size_t n, const char *p, size_t len) {
+		Chan_t &c = chan[n];
+		uint64_t deadline = clock.NowMs() + c.writeTimeoutMs;
+		size_t done;
+		int res;
+
+		while (TxFree(n) == 0) {
+			if (clock.NowMs() >= deadline)
+				return -EAGAIN;
+
+			if ((res = Poll(POLL_MS)) < 0)
+				return res;
+		}
+
+		for (done = 0; (done < len) && (c.txCount < BUFF_SIZE); done++) {
+			c.txBuff[(c.txHead + c.txCount) % BUFF_SIZE] = p[done];
+			c.txCount++;
+		}
+
+		res = pumpTx();
+		return (res < 0) ? res : done;
+	}
+
+	int read(size_t n, char *p, size_t len, size_t timeoutMs) {
+		Chan_t &c = chan[n];
+		uint64_t deadline;
+		uint64_t now;
+		size_t done;
+		int res;
+
+		if ((res = Poll(0)) < 0)
+			return res;
+
+		// Ожидание интервалами не длиннее POLL_MS - передача других каналов не задерживается
+		deadline = (c.rxCount == 0) ? clock.NowMs() + timeoutMs : 0;
+		while ((c.rxCount == 0) && ((now = clock.NowMs()) < deadline)) {
+			if ((res = Poll((deadline - now < POLL_MS) ? deadline - now : POLL_MS)) < 0)
+				return res;
+		}
+
+		for (done = 0; (done < len) && (c.rxCount > 0); done++) {
+			p[done] = c.rxBuff[c.rxHead];
+			c.rxHead = (c.rxHead + 1) % BUFF_SIZE;
+			c.rxCount--;
+		}
+
+		// Кредит возвращается порциями от четверти буфера
+		if ((uint16_t)(rxLimit(c) - c.rxAdvertised) >= BUFF_SIZE / 4) {
+			c.creditPending = true;
+			if ((res = pumpTx()) < 0)
+				return res;
+		}
+
+		return done;
+	}
+
+	int drain(size_t n) {
+		uint64_t deadline = clock.NowMs() + WRITE_TIMEOUT_MS;
+		int res;
+
+		while (chan[n].txCount > 0) {
+			if (clock.NowMs() >= deadline)
+				return -ETIMEDOUT;
+
+			if ((res = Poll(POLL_MS)) < 0)
+				return res;
+		}
+
+		return link.Drain();
+	}
+
+
+private:
+	ParallelStream &link;
+	Clock &clock;
+
+	Chan_t chan[CHANNELS];
+	size_t rr;					// Следующий канал при равных приоритетах
+	uint64_t lastRxMs;			// Момент последнего приёма
+
+	struct {
+		uint8_t buff[FRAME_MAX];
+		size_t len;				// FRAME_MAX + 1 - отбрасывание до FLAG
+		bool esc;
+	} parse;
+
+	Stats_t stats;
+};
+
+
+
+#endif /* __CHANNEL_MUX_H__ */
@@ -0,0 +1,97 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+
+/**
+ * Источник времени для таймаутов и интервалов.
+ *
+ * Потоки и терминал отсчитывают время только через Clock: с VirtualClock
+ * сценарии с таймаутами и повторами выполняются без реального ожидания.
+ */
+class Clock {
+public:
+	// Монотонное время, нс
+	virtual uint64_t NowNs() = 0;
+
+	virtual void SleepNs(uint64_t ns) = 0;
+
+	uint64_t NowMs() {
+		return NowNs() / 1000000ull;
+	}
+
+	/**
+	 * Ожидание момента whenNs (если он ещё не наступил).
+	 *
+	 * Вызывается после чтения потока, завершённого по таймауту: поток мог
+	 * вернуть управление раньше срока (в том числе поток без собственного
+	 * учёта времени с VirtualClock), остаток выдерживается часами.
+	 */
+	void WaitUntilNs(uint64_t whenNs) {
+		uint64_t now = NowNs();
+
+		if (whenNs > now)
+			SleepNs(whenNs - now);
+	}
+};
+
+
+// Реальное время (std::chrono::steady_clock)
+class MonotonicClock : public Clock {
+public:
+	uint64_t NowNs() final {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void SleepNs(uint64_t ns) final {
+		std::this_thread::sleep_for(std::chrono::nanoseconds(ns));
+	}
+
+	// Часы по умолчанию
+	static MonotonicClock & Instance() {
+		static MonotonicClock clock;
+		return clock;
+	}
+};
+
+
+/**
+ * Виртуальное время: изменяется только вызовами Advance и SleepNs.
+ * Ожидание сразу продвигает время на заданный интервал.
+ */
+class VirtualClock : public Clock {
+public:
+	VirtualClock(uint64_t startNs = 0)
+	:
+	now(startNs)
+	{}
+
+	uint64_t NowNs() final {
+		return now.load(std::memory_order_acquire);
+	}
+
+	void SleepNs(uint64_t ns) final {
+		Advance(ns);
+	}
+
+	void Advance(uint64_t ns) {
+		now.fetch_add(ns, std::memory_order_acq_rel);
+	}
+
+	void AdvanceMs(uint64_t ms) {
+		Advance(ms * 1000000ull);
+	}
+
+private:
+	std::atomic<uint64_t> now;
+};
+
+
+
+#endif /* __CLOCK_H__ */
@@ -2,6 +2,7 @@
 #define __COMMAND_PROCESSOR_H__
 
 #include <stddef.h>
+#include <stdlib.h>
 
 #include "terminal.h"
 
@@ -66,21 +67,41 @@ namespace cmdproc {
 
 class CommandProcessor {
 public:
-	static const size_t MAX_INPUT_LEN = 64;
+	static const size_t MAX_INPUT_LEN = 64;		// Длина строки со встроенным буфером
 
 	static const size_t MAX_CMD = 32;
-	static const size_t MAX_ARGS = 16;
+	static const size_t MAX_ARGS = 32;
 
 	static const inline char NEWLINE[] = "\r\n";
 	static const inline char DEFAULT_PREFIX[] = ">> ";
 
 	static const inline char HELP_ARG[] = "help";
 
+	static const uint32_t BAUD_CONFIRM_MS = 5000;
+	static const uint32_t BAUD_CONFIRM_POLL_MS = 100;
+	static const size_t BAUD_CONFIRM_MAX_GARBAGE = 256;
+
 public:
-	CommandProcessor(Terminal &t)
+	/**
+	 * @param buff Память строки ввода: 2 * size байт (строка и её копия для разбора).
+	 *             nullptr - встроенный буфер на MAX_INPUT_LEN символов
+	 * @param size Размер строки ввода, включая '\0'
+	 */
+	CommandProcessor(Terminal &t, char *buff = nullptr, size_t size = 0)
 	:
-	term(t)
+	term(t),
+	promptShown(false)
 	{
+		if (buff == nullptr) {
+			buff = builtin;
+			size = MAX_INPUT_LEN + 1;
+		}
+
+		input = buff;
+		parse = &buff[size];
+		inputSize = size;
+		input[0] = '\0';
+
 		prefix = DEFAULT_PREFIX;
 
 		for (auto &cmd : commands)
@@ -88,6 +109,7 @@ public:
 
 		Register(baseCmd_Reset);
 		Register(baseCmd_Help);
+		Register(baseCmd_Baud);
 	}
 
 	void Register(cmdproc::CmdDef_t &a_cmd) {
@@ -119,14 +141,55 @@ public:
 		prefix = pref;
 	}
 
-	void Run() {
-		char input[MAX_INPUT_LEN];
+	/**
+	 * Согласованная смена скорости канала:
+	 *  1. Объявление новой скорости на текущей скорости;
+	 *  2. Ожидание передачи вывода и переключение;
+	 *  3. Ожидание подтверждения (Enter) на новой скорости не дольше confirmMs;
+	 *  4. Без подтверждения - возврат прежней скорости.
+	 *
+	 * @return 0 - скорость изменена, иначе отрицательный код ошибки
+	 *         (прежняя скорость сохранена)
+	 */
+	int SwitchSpeed(uint32_t baud, uint32_t confirmMs = BAUD_CONFIRM_MS) {
+		char tmp[96];
+		uint32_t prev = term.GetSpeed();
+		int res;
+
+		if (prev == 0)
+			return -ENOTSUP;
+
+		if (baud == prev)
+			return 0;
+
+		sprintf(tmp, "Switching to %u baud. Press Enter at the new speed within %u ms.\r\n",
+				baud, confirmMs);
+		term.Puts(tmp);
+
+		if ((res = term.SetSpeed(baud)) < 0) {
+			if (res != -ENOTSUP)
+				term.Puts("Failed to change baud rate.");
+			return res;
+		}
+
+		if ((res = waitSpeedConfirm(confirmMs)) == 0) {
+			sprintf(tmp, "Baud rate: %u", baud);
+			term.Puts(tmp);
+			return 0;
+		}
+
+		term.SetSpeed(prev);
 
+		sprintf(tmp, "No confirmation, baud rate restored: %u", prev);
+		term.Puts(tmp);
+		return res;
+	}
+
+	void Run() {
 		while (1) {
-			term.Puts(NEWLINE);
-			term.Puts(prefix);
+			printPrompt();
 
-			if (term.Gets(input) == nullptr)
+			if (term.Gets(input, inputSize) == nullptr)
 				continue;
 
 			if (strlen(input) == 0)
@@ -137,23 +200,86 @@ public:
 		}
 	}
 
+	/**
+	 * Неблокирующий аналог Run для цикла событий: обработка уже принятого
+	 * ввода и выполнение завершённых команд.
+	 *
+	 * @return 0 или отрицательный код ошибки потока (сеанс завершён)
+	 */
+	int Poll() {
+		int res;
+
+		while (1) {
+			if (!promptShown) {
+				printPrompt();
+				promptShown = true;
+			}
+
+			res = term.GetsStep(input, inputSize, 0);
+			if (res <= 0)
+				return res;
+
+			promptShown = false;
+
+			if (strlen(input) == 0)
+				continue;
+
+			term.Puts(NEWLINE);
+			Exec(input);
+		}
+	}
+
+	/**
+	 * Ввод через Terminal::Feed (цикл событий, обработчик приёма RTOS):
+	 * команды выполняются по мере завершения строк, без опроса потока.
+	 * Выводит приглашение ввода.
+	 */
+	void Listen() {
+		term.SetLineHandler(input, inputSize, [](void *ctx, char *line)
+				{ reinterpret_cast<CommandProcessor *>(ctx)->OnLine(line); }, this);
+
+		printPrompt();
+		term.Flush();
+	}
+
+	// Завершённая строка ввода: выполнение команды и приглашение для следующей
+	void OnLine(const char *line) {
+		if (strlen(line) > 0) {
+			term.Puts(NEWLINE);
+			Exec(line);
+		}
+
+		printPrompt();
+	}
+
+	/**
+	 * Выполнение команды. Строка длиннее буфера ввода усекается.
+	 * Не допускает вложенного вызова из выполняемой команды.
+	 */
 	int Exec(const char *input) {
 		size_t len = strlen(input);
 		// Клон входного буфера
-		char inputBuff[MAX_INPUT_LEN + 1];
+		char *inputBuff = parse;
 
 		if (len == 0)
 			return -1;
 
 		// Копирование входного буфера
-		memcpy(inputBuff, input, MAX_INPUT_LEN);
-		inputBuff[MAX_INPUT_LEN] = '\0';
+		if (len >= inputSize)
+			len = inputSize - 1;
+		memcpy(inputBuff, input, len);
+		inputBuff[len] = '\0';
 
-		char *argv[MAX_ARGS];
+		char *argv[MAX_ARGS + 1];
 		int argc = 0;
 		int quotes = 0;
 		argv[argc++] = inputBuff;
 		for (char *c = inputBuff; *c != '\0'; c++) {
+			if ((argc == MAX_ARGS) && (quotes == 0) && ((*c == ' ') || (*c == '"'))) {
+				printError(argv[0], ": too many arguments.");
+				return -1;
+			}
+
 			if ((*c == ' ') && (quotes == 0)) {
 				*c = '\0';
 				argv[argc++] = c + 1;
@@ -170,6 +296,7 @@ public:
 					quotes = 0;
 			}
 		}
+		argv[argc] = nullptr;
 
 		cmdproc::CmdDef_t *cmd = nullptr;
 
@@ -186,8 +313,7 @@ public:
 
 		// Если команда не найдена
 		if (cmd == nullptr) {
-			term.Puts(argv[0]);
-			term.Puts(": command not found. Use \"help\" to get available commands.");
+			printError(argv[0], ": command not found. Use \"help\" to get available commands.");
 			return -1;
 		}
 
@@ -258,15 +384,8 @@ public:
 					if (cmdOpt->argc < optArgN) {
 						// Если не соответствует - ошибка, т.к. производится переход к следующей опции,
 						// а предыдущая ещё не заполнена
-						if (cmdOpt->ref->full != nullptr) {
-							term.Puts("--");
-							term.Puts(cmdOpt->ref->full);
-						} else {
-							term.Putc('-');
-							term.Putc(cmdOpt->ref->ch);
-						}
-						term.Puts(": invalid number of option arguments. "
-								  "Use \"--help\" option to get available command options.");
+						printOptionError(*cmdOpt->ref, ": invalid number of option arguments. "
+														"Use \"--help\" option to get available command options.");
 						return -1;
 					}
 					else {
@@ -312,8 +431,7 @@ public:
 				// Опция выбрана?
 				if (cmdOpt->ref == nullptr) {
 					// Опция не выбрана - ошибка о неизвестной опции
-					term.Puts(argS);
-					term.Puts(": unknown option. Use \"--help\" option to get available command options.");
+					printError(argS, ": unknown option. Use \"--help\" option to get available command options.");
 					return -1;
 				}
 			}
@@ -345,16 +463,8 @@ public:
 			// Выбрана опция
 			if ((optArgN < cmdOpt->argc)) {
 				// Опции недостаточно аргументов
-				if (cmdOpt->ref->full != nullptr) {
-					term.Puts("--");
-					term.Puts(cmdOpt->ref->full);
-				} else {
-					term.Putc('-');
-					term.Putc(cmdOpt->ref->ch);
-				}
-
-				term.Puts(": invalid number of option arguments. "
-						  "Use \"--help\" option to get available command options.");
+				printOptionError(*cmdOpt->ref, ": invalid number of option arguments. "
+											   "Use \"--help\" option to get available command options.");
 				return -1;
 			}
 
@@ -376,6 +486,42 @@ public:
 	}
 
 private:
+	void printPrompt() {
+		const ParallelStream::Fragment_t prompt[] = {
+				{NEWLINE, sizeof(NEWLINE) - 1},
+				{prefix, strlen(prefix)},
+		};
+
+		term.WriteV(prompt, 2);
+	}
+
+	// Вывод "<name><err>" одним сообщением
+	void printError(const char *name, const char *err) {
+		const ParallelStream::Fragment_t msg[] = {
+				{name, strlen(name)},
+				{err, strlen(err)},
+		};
+		term.WriteV(msg, 2);
+	}
+
+	// Вывод "--<option><err>" или "-<o><err>" одним сообщением
+	void printOptionError(const cmdproc::CmdOpt_t &opt, const char *err) {
+		ParallelStream::Fragment_t msg[] = {
+				{"--", 2},
+				{opt.full, 0},
+				{err, strlen(err)},
+		};
+
+		if (opt.full != nullptr) {
+			msg[1].len = strlen(opt.full);
+		} else {
+			msg[0] = {"-", 1};
+			msg[1] = {&opt.ch, 1};
+		}
+
+		term.WriteV(msg, 3);
+	}
+
 	void PrintCommandHelp(cmdproc::CmdDef_t &cmd) {
 		size_t len;
 		cmdproc::CmdOpt_t *opt;
@@ -465,6 +611,12 @@ private:
 	const char *prefix;
 	cmdproc::CmdDef_t *commands[MAX_CMD];
 
+	char *input;				// Строка ввода
+	char *parse;				// Копия строки для разбора (Exec)
+	size_t inputSize;
+	char builtin[2 * (MAX_INPUT_LEN + 1)];
+	bool promptShown;
+
 private:
 
 
@@ -477,6 +629,73 @@ private:
 		return 0;
 	}
 
+	int CmdFn_Baud(cmdproc::CmdArgs_t &a) {
+		char tmp[48];
+		uint32_t confirmMs = BAUD_CONFIRM_MS;
+		uint32_t baud;
+		int res;
+
+		cmdproc::OptArgs_t *opt = a.opts;
+		for (int i = 0; i < a.optc; i++, opt++)
+			switch (opt->ref->ch) {
+				case 'w':	// --wait
+					confirmMs = strtoul(opt->argv[0], nullptr, 10);
+					break;
+			}
+
+		// Без аргумента - вывод текущей скорости
+		if (a.argc == 0) {
+			baud = term.GetSpeed();
+			if (baud == 0) {
+				term.Puts("Baud rate is not available on this link.");
+				return -1;
+			}
+
+			sprintf(tmp, "Baud rate: %u", baud);
+			term.Puts(tmp);
+			return 0;
+		}
+
+		baud = strtoul(a.argv[0], nullptr, 10);
+		if (baud == 0) {
+			term.Puts("Invalid baud rate.");
+			return -1;
+		}
+
+		res = SwitchSpeed(baud, confirmMs);
+		if (res == -ENOTSUP)
+			term.Puts("Baud rate change is not supported on this link.");
+
+		return (res < 0) ? -1 : 0;
+	}
+
+	// Ожидание Enter на новой скорости. Байты, принятые на несовпадающей
+	// скорости, пропускаются.
+	int waitSpeedConfirm(uint32_t timeoutMs) {
+		Clock &clock = term.GetClock();
+		uint64_t deadline = clock.NowMs() + timeoutMs;
+		uint64_t now;
+		size_t garbage = 0;
+		int res;
+
+		while ((now = clock.NowMs()) < deadline) {
+			res = term.Getc((deadline - now < BAUD_CONFIRM_POLL_MS) ? deadline - now : BAUD_CONFIRM_POLL_MS);
+
+			if (res == -ENODATA)
+				continue;
+			else if (res < 0)
+				return res;
+
+			if ((res == ANSI::KEY_RETURN) || (res == ANSI::KEY_NEW_LINE))
+				return 0;
+
+			if (++garbage > BAUD_CONFIRM_MAX_GARBAGE)
+				return -EPROTO;
+		}
+
+		return -ETIMEDOUT;
+	}
+
 	int CmdFn_Help() {
 		for (auto &cmd : commands) {
 			if (cmd == nullptr)
@@ -527,6 +746,30 @@ private:
 			.descr = "Display all commands."
 	};
 
+	cmdproc::CmdOpt_t baseOpts_Baud[1] = {
+			{
+					.ch = 'w',
+					.full = "wait",
+					.args = "ms",
+					.description = "Confirmation timeout (default 5000 ms).",
+			},
+	};
+
+	cmdproc::CmdDef_t baseCmd_Baud = {
+			.fn = [](void *ctx, Terminal &t, cmdproc::CmdArgs_t &a) -> int
+					{ return reinterpret_cast<CommandProcessor *>(ctx)->CmdFn_Baud(a); },
+			.ctx = this,
+			.cmd = "baud",
+			.args = "~rate",
+			.options = baseOpts_Baud,
+			.optc = sizeof(baseOpts_Baud) / sizeof(cmdproc::CmdOpt_t),
+			.descr = "Display or change the link speed.\r\n"
+					 "\r\n"
+					 "The new speed is announced at the current speed, then the link\r\n"
+					 "is switched and Enter is expected at the new speed. Without\r\n"
+					 "confirmation the previous speed is restored."
+	};
+
 };
 
 
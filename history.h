@@ -0,0 +1,275 @@
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+namespace history {
+	static const size_t NOT_FOUND = (size_t)-1;
+
+	// Сигнатура строки для отбора при поиске: символы (биты 0..31)
+	// и пары соседних символов (биты 32..63)
+	inline uint64_t Signature(const char *s) {
+		uint64_t sig = 0;
+
+		for (; *s != '\0'; s++) {
+			sig |= 1ull << ((uint8_t)s[0] % 32);
+
+			if (s[1] != '\0')
+				sig |= 1ull << (32 + ((uint8_t)s[0] * 31u + (uint8_t)s[1]) % 32);
+		}
+
+		return sig;
+	}
+
+	// FNV-1a
+	inline uint32_t Hash(const char *s) {
+		uint32_t h = 2166136261u;
+
+		while (*s != '\0')
+			h = (h ^ (uint8_t)*(s++)) * 16777619u;
+
+		return h;
+	}
+}
+
+
+/**
+ * Внешнее хранилище истории (например, файл), заменяющее History
+ * при просмотре и поиске. Строки нумеруются от новейшей (0).
+ */
+class HistoryStore {
+public:
+	virtual ~HistoryStore() {}
+
+	virtual void Append(const char *s) = 0;
+
+	/**
+	 * @return Строка n (действительна до следующего вызова) или nullptr, если её нет
+	 */
+	virtual const char * Get(size_t n) = 0;
+
+	/**
+	 * Поиск строки, содержащей q: от строки n (включительно) к более старым
+	 * (back) или к более новым.
+	 *
+	 * @return Номер строки или history::NOT_FOUND
+	 */
+	virtual size_t Find(const char *q, size_t n, bool back) = 0;
+};
+
+
+/**
+ * История введённых строк.
+ *
+ * Строки хранятся подряд в кольцевом буфере байт, их смещения - в кольцевом
+ * индексе. Добавление, вытеснение самых старых строк и доступ к строке
+ * по номеру - без поиска разделителей и сдвига буфера. Строка в буфере
+ * непрерывна: не помещающаяся до конца буфера записывается с его начала.
+ *
+ * Черновик (Write) - редактируемая строка, сохраняемая на время просмотра
+ * истории; Save делает его новейшей записью.
+ *
+ * @tparam ENTRIES Количество строк
+ * @tparam BYTES   Размер буфера строк, байт (включая '\0' каждой строки)
+ * @tparam DEDUP   Количество новейших строк, проверяемых на совпадение
+ *                 с сохраняемой (по хэшу); совпавшая строка удаляется.
+ *                 0 - без проверки.
+ */
+template <size_t ENTRIES, size_t BYTES, size_t DEDUP = 0>
+class History {
+	static_assert(ENTRIES > 0, "History needs at least one entry");
+	static_assert(DEDUP <= ENTRIES, "History DEDUP exceeds ENTRIES");
+
+public:
+	static const size_t NOT_FOUND = history::NOT_FOUND;
+
+public:
+	History() {
+		Clear();
+	}
+
+	void Clear() {
+		first = count = 0;
+		wr = 0;
+		draft = false;
+	}
+
+	/**
+	 * Запись черновика (заменяет предыдущий). Для места вытесняются
+	 * самые старые строки.
+	 *
+	 * @return false - пустая или не помещающаяся в буфер строка (черновик удалён)
+	 */
+	bool Write(const char *s) {
+		size_t len = strlen(s) + 1; // len + '\0'
+		size_t p;
+
+		draft = false;
+
+		if ((len == 1) || (len > BYTES))
+			return false;
+
+		// Место сразу за новейшей строкой или с начала буфера
+		p = (BYTES - wr >= len) ? wr : 0;
+
+		while (!fits(p, len)) {
+			evict();
+
+			if (count == 0)
+				p = wr = 0;
+		}
+
+		memcpy(&buff[p], s, len);
+
+		Entry_t &e = at(count);
+		e.off = p;
+		e.len = len - 1;
+		e.hash = history::Hash(s);
+		e.sig = history::Signature(s);
+
+		draft = true;
+		return true;
+	}
+
+	// Черновик - новейшая строка
+	void Save() {
+		if (!draft)
+			return;
+
+		draft = false;
+		wr = at(count).off + at(count).len + 1;
+
+		// Совпадающая строка удаляется, более новые сдвигаются в индексе
+		for (size_t n = 0; (n < DEDUP) && (n < count); n++) {
+			size_t i = count - 1 - n;
+
+			if (same(at(i), at(count))) {
+				for (; i < count; i++)
+					at(i) = at(i + 1);
+				return;
+			}
+		}
+
+		if (count == ENTRIES)
+			evict();
+
+		count++;
+	}
+
+	void Push(const char *s) {
+		if (Write(s))
+			Save();
+	}
+
+	// Количество сохранённых строк
+	size_t Size() const {
+		return count;
+	}
+
+	/**
+	 * Сохранённая строка по номеру: 0 - новейшая.
+	 *
+	 * @return nullptr, если строки нет
+	 */
+	const char * Get(size_t n) const {
+		if (n >= count)
+			return nullptr;
+
+		return &buff[at(count - 1 - n).off];
+	}
+
+	/**
+	 * Поиск строки, содержащей q: от строки n (включительно) к более старым
+	 * (back) или к более новым. Строки, в которых нет символов или пар
+	 * символов q, отбрасываются по сигнатуре без сравнения.
+	 *
+	 * @return Номер строки (Get) или NOT_FOUND
+	 */
+	size_t Find(const char *q, size_t n, bool back) const {
+		uint64_t sig = history::Signature(q);
+
+		// К более новым - до n = 0, затем n переполняется и становится >= count
+		for (; n < count; n = back ? n + 1 : n - 1) {
+			const Entry_t &e = at(count - 1 - n);
+
+			if (((e.sig & sig) == sig) && (strstr(&buff[e.off], q) != nullptr))
+				return n;
+		}
+
+		return NOT_FOUND;
+	}
+
+	// Черновик или пустая строка
+	const char * Draft() const {
+		return draft ? &buff[at(count).off] : "";
+	}
+
+	static constexpr size_t Capacity() {
+		return ENTRIES;
+	}
+
+private:
+	typedef struct {
+		size_t off;			// Смещение строки в буфере
+		size_t len;			// Длина без '\0'
+		uint32_t hash;
+		uint64_t sig;		// Символы (биты 0..31) и пары символов (биты 32..63)
+	} Entry_t;
+
+	// Ячейка черновика - за новейшей строкой
+	static const size_t SLOTS = ENTRIES + 1;
+
+private:
+	// Запись индекса по номеру от самой старой строки
+	Entry_t & at(size_t i) {
+		return index[(first + i) % SLOTS];
+	}
+
+	const Entry_t & at(size_t i) const {
+		return index[(first + i) % SLOTS];
+	}
+
+	void evict() {
+		first = (first + 1) % SLOTS;
+		count--;
+	}
+
+	// Участок [p, p + len) не пересекается с сохранёнными строками
+	bool fits(size_t p, size_t len) const {
+		size_t o;
+
+		if (count == 0)
+			return true;
+
+		o = at(0).off;
+
+		// Строки занимают [o, wr)
+		if (o < wr)
+			return (p == wr) || (p + len <= o);
+
+		// Строки занимают [o, BYTES) и [0, wr)
+		return (p == wr) && (p + len <= o);
+	}
+
+	bool same(const Entry_t &a, const Entry_t &b) const {
+		return (a.hash == b.hash) && (a.len == b.len) && (memcmp(&buff[a.off], &buff[b.off], a.len) == 0);
+	}
+
+
+
+private:
+	char buff[BYTES];
+	Entry_t index[SLOTS];
+
+	size_t first;			// Ячейка самой старой строки
+	size_t count;			// Сохранённые строки
+	size_t wr;				// Конец новейшей строки в буфере
+	bool draft;
+};
+
+
+
+#endif /* __HISTORY_H__ */
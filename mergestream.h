@@ -0,0 +1,353 @@
+#ifndef __MERGE_STREAM_H__
+#define __MERGE_STREAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "paralstream.h"
+#include "clock.h"
+
+
+/**
+ * Объединение нескольких потоков (процессоров) в один: команда "select A/B/AB/BA".
+ *
+ * Запись передаётся выбранным для ввода потокам, чтение возвращает строки
+ * выбранных для вывода потоков. Каждый источник накапливает строку в собственном
+ * буфере, в вывод строки попадают целиком - строки разных источников
+ * не перемешиваются. При выводе нескольких источников строка начинается
+ * с метки: "[A] ".
+ *
+ * Незавершённая строка (например, приглашение ввода) выводится, если источник
+ * не передаёт данные дольше PARTIAL_MS, а при единственном источнике вывода -
+ * сразу. Если затем выводится строка другого источника, незавершённая строка
+ * прерывается переводом строки, а её продолжение выводится с меткой.
+ *
+ * Данные принимаются и копируются блоками (memchr/memcpy), без обработки
+ * и блокировок на каждый байт. Обмен выполняется во время вызовов методов,
+ * отдельный поток выполнения не требуется. Не потокобезопасен.
+ *
+ * @tparam SOURCES   Количество источников (не более 32)
+ * @tparam LINE_SIZE Размер буфера строки источника, байт
+ */
+template <size_t SOURCES, size_t LINE_SIZE = 256>
+class MergeStream : public ParallelStream {
+	static_assert((SOURCES > 0) && (SOURCES <= 32), "MergeStream supports 1..32 sources");
+
+public:
+	static const size_t OUT_SIZE = 2 * LINE_SIZE;
+	static const size_t POLL_MS = 10;
+	static const size_t PARTIAL_MS = 50;
+	static const size_t TAG_LEN = 4;		// "[A] "
+
+public:
+	MergeStream(Clock &a_clock = MonotonicClock::Instance())
+	:
+	clock(a_clock),
+	inMask(0),
+	outMask(0),
+	writeTimeoutMs(SIZE_MAX),
+	owner(NO_OWNER),
+	rr(0)
+	{
+		for (size_t i = 0; i < SOURCES; i++) {
+			src[i].stream = nullptr;
+			src[i].name = '\0';
+			src[i].len = 0;
+			src[i].lastMs = 0;
+			src[i].tagged = false;
+		}
+
+		out.rPos = out.wPos = 0;
+	}
+
+	/**
+	 * Подключение источника.
+	 *
+	 * @param name Имя для Select и меток вывода
+	 */
+	void Attach(size_t n, ParallelStream &stream, char name) {
+		src[n].stream = &stream;
+		src[n].name = name;
+	}
+
+	/**
+	 * Выбор потоков по маскам (бит n - источник n).
+	 * Строки, уже принятые от исключённых из вывода источников, отбрасываются.
+	 */
+	void Select(uint32_t a_inMask, uint32_t a_outMask) {
+		for (size_t i = 0; i < SOURCES; i++)
+			if (!(a_outMask & (1u << i))) {
+				src[i].len = 0;
+				src[i].tagged = false;
+			}
+
+		if ((owner != NO_OWNER) && !(a_outMask & (1u << owner)))
+			owner = NO_OWNER;
+
+		inMask = a_inMask;
+		outMask = a_outMask;
+	}
+
+	/**
+	 * Выбор по именам: "A" - ввод и вывод A; "AB" - вывод A и B, ввод только в B;
+	 * "BA" - вывод A и B, ввод только в A.
+	 *
+	 * @return 0 или -EINVAL при неизвестном имени
+	 */
+	int Select(const char *target) {
+		uint32_t in = 0;
+		uint32_t outputs = 0;
+		size_t n;
+
+		if (*target == '\0')
+			return -EINVAL;
+
+		for (const char *c = target; *c != '\0'; c++) {
+			for (n = 0; (n < SOURCES) && ((src[n].stream == nullptr) || (src[n].name != *c)); n++);
+
+			if (n == SOURCES)
+				return -EINVAL;
+
+			outputs |= 1u << n;
+			in = 1u << n;		// Ввод - в последний из перечисленных
+		}
+
+		Select(in, outputs);
+		return 0;
+	}
+
+	uint32_t GetInputMask() const {
+		return inMask;
+	}
+
+	uint32_t GetOutputMask() const {
+		return outMask;
+	}
+
+	// -ENOTCONN, если ни один поток не выбран для ввода; -EAGAIN, если поток
+	// не принял данные за время таймаута записи
+	int Write(const char *p, size_t len) final {
+		uint64_t deadline = (writeTimeoutMs == SIZE_MAX) ? UINT64_MAX : clock.NowMs() + writeTimeoutMs;
+		int res;
+
+		if (inMask == 0)
+			return -ENOTCONN;
+
+		for (size_t i = 0; i < SOURCES; i++)
+			if ((inMask & (1u << i)) && ((res = writeAll(*src[i].stream, p, len, deadline)) < 0))
+				return res;
+
+		return len;
+	}
+
+	int WriteByte(char c) final {
+		return Write(&c, 1);
+	}
+
+	int ReadByte(char *c, size_t timeoutMs) final {
+		return Read(c, 1, timeoutMs);
+	}
+
+	int Read(char *p, size_t len, size_t timeoutMs) final {
+		uint64_t deadline = clock.NowMs() + timeoutMs;
+		uint64_t now;
+		size_t n;
+		int res;
+
+		while (out.rPos == out.wPos) {
+			if ((res = pump(0)) < 0)
+				return res;
+			if ((out.rPos != out.wPos) || ((now = clock.NowMs()) >= deadline))
+				break;
+
+			// Ожидание интервалами POLL_MS на источниках по очереди
+			if ((res = pump((deadline - now < POLL_MS) ? deadline - now : POLL_MS)) < 0)
+				return res;
+		}
+
+		n = out.wPos - out.rPos;
+		if (n > len)
+			n = len;
+
+		memcpy(p, &out.buff[out.rPos], n);
+		out.rPos += n;
+		if (out.rPos == out.wPos)
+			out.rPos = out.wPos = 0;
+
+		return n;
+	}
+
+	int Flush() final {
+		return forEachInput(&ParallelStream::Flush);
+	}
+
+	int Drain() final {
+		return forEachInput(&ParallelStream::Drain);
+	}
+
+	// Повтор записи в поток, вернувший -EAGAIN (по умолчанию - без ограничения)
+	size_t SetWriteTimeout(size_t timeoutMs) final {
+		size_t prev = writeTimeoutMs;
+
+		writeTimeoutMs = timeoutMs;
+		return prev;
+	}
+
+private:
+	typedef struct {
+		ParallelStream *stream;
+		char name;
+
+		char line[LINE_SIZE];	// Незавершённая строка
+		size_t len;
+		uint64_t lastMs;		// Момент поступления последних данных
+		bool tagged;			// Начало строки уже выведено (с меткой)
+	} Source_t;
+
+	static const size_t NO_OWNER = SOURCES;
+
+private:
+	int writeAll(ParallelStream &s, const char *p, size_t len, uint64_t deadline) {
+		int res;
+
+		for (size_t done = 0; done < len; done += res) {
+			res = s.Write(&p[done], len - done);
+			if ((res == -EAGAIN) && (clock.NowMs() < deadline))
+				res = 0;
+			else if (res <= 0)
+				return (res < 0) ? res : -EIO;
+		}
+
+		return 0;
+	}
+
+	int forEachInput(int (ParallelStream::*fn)()) {
+		int res;
+
+		for (size_t i = 0; i < SOURCES; i++)
+			if ((inMask & (1u << i)) && ((res = (src[i].stream->*fn)()) < 0))
+				return res;
+
+		return 0;
+	}
+
+	bool tagsEnabled() const {
+		return (outMask & (outMask - 1)) != 0;
+	}
+
+	// Приём от источников вывода: без ожидания или с ожиданием timeoutMs
+	// на первом из них
+	int pump(size_t timeoutMs) {
+		uint64_t start = (timeoutMs > 0) ? clock.NowNs() : 0;
+		size_t wait = timeoutMs;
+		uint64_t now;
+		size_t n;
+		int res;
+
+		for (size_t k = 0; k < SOURCES; k++) {
+			n = (rr + k) % SOURCES;
+			Source_t &s = src[n];
+
+			if (!(outMask & (1u << n)))
+				continue;
+
+			// Буфер строки заполнен, а места в выводе нет - данные остаются в источнике
+			if (s.len == LINE_SIZE)
+				res = 0;
+			else if ((res = s.stream->Read(&s.line[s.len], LINE_SIZE - s.len, wait)) < 0)
+				return res;
+
+			// Источник завершил ожидание раньше срока - остаток выдерживается часами
+			if ((res == 0) && (wait > 0))
+				clock.WaitUntilNs(start + wait * 1000000ull);
+			wait = 0;
+
+			now = clock.NowMs();
+
+			if (res == 0) {
+				if ((s.len > 0) && (now - s.lastMs >= PARTIAL_MS))
+					emit(n, s.len, false);
+				continue;
+			}
+
+			s.lastMs = now;
+			s.len += res;
+			emitLines(n);
+
+			// Строка длиннее буфера выводится частями. Единственный источник
+			// выводится без ожидания конца строки (эхо ввода).
+			if ((s.len == LINE_SIZE) || ((s.len > 0) && !tagsEnabled()))
+				emit(n, s.len, false);
+		}
+
+		rr = (rr + 1) % SOURCES;
+		return 0;
+	}
+
+	// Вывод завершённых строк источника
+	void emitLines(size_t n) {
+		Source_t &s = src[n];
+		const char *nl;
+
+		while ((s.len > 0) && ((nl = (const char *)memchr(s.line, '\n', s.len)) != nullptr))
+			if (!emit(n, nl - s.line + 1, true))
+				return;
+	}
+
+	// Вывод первых len байт строки источника n. false - нет места в выводе.
+	bool emit(size_t n, size_t len, bool complete) {
+		Source_t &s = src[n];
+
+		if (OUT_SIZE - out.wPos < 2 + TAG_LEN + len)
+			return false;
+
+		// Чужая незавершённая строка прерывается
+		if ((owner != NO_OWNER) && (owner != n)) {
+			put("\r\n", 2);
+			src[owner].tagged = false;
+			owner = NO_OWNER;
+		}
+
+		if (!s.tagged && tagsEnabled()) {
+			const char tag[TAG_LEN] = {'[', s.name, ']', ' '};
+			put(tag, TAG_LEN);
+		}
+
+		put(s.line, len);
+		s.len -= len;
+		memmove(s.line, &s.line[len], s.len);
+
+		s.tagged = !complete;
+		owner = complete ? NO_OWNER : n;
+		return true;
+	}
+
+	void put(const char *p, size_t len) {
+		memcpy(&out.buff[out.wPos], p, len);
+		out.wPos += len;
+	}
+
+
+private:
+	Clock &clock;
+	Source_t src[SOURCES];
+
+	uint32_t inMask;
+	uint32_t outMask;
+	size_t writeTimeoutMs;
+
+	size_t owner;		// Источник, незавершённая строка которого выведена последней
+	size_t rr;			// Источник, ожидаемый первым
+
+	struct {
+		char buff[OUT_SIZE];
+		size_t rPos;
+		size_t wPos;
+	} out;
+};
+
+
+
+#endif /* __MERGE_STREAM_H__ */
@@ -2,17 +2,162 @@
 #define __PARALLEL_STREAM_H__
 
 #include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
 
 
 class ParallelStream {
 public:
-	//virtual int Receive(uint8_t *p, size_t len) = 0;
+	typedef struct {
+		const char *p;
+		size_t len;
+	} Fragment_t;
 
+	/**
+	 * Завершение асинхронной записи.
+	 * Может вызываться из прерывания или другого потока выполнения.
+	 *
+	 * @param res Количество переданных байт или отрицательный код ошибки
+	 */
+	typedef void (*TWriteDone)(void *ctx, int res);
+
+public:
 	virtual int Write(const char *p, size_t len) = 0;
 
+	/**
+	 * Запись нескольких фрагментов одного сообщения (аналог writev).
+	 *
+	 * @return Количество записанных байт или отрицательный код ошибки
+	 */
+	virtual int WriteV(const Fragment_t *frags, size_t n) {
+		size_t done = 0;
+		int res;
+
+		for (size_t i = 0; i < n; i++) {
+			if (frags[i].len == 0)
+				continue;
+
+			res = Write(frags[i].p, frags[i].len);
+			if (res < 0)
+				return (done > 0) ? done : res;
+
+			done += res;
+
+			// Частичная запись - остальные фрагменты не отправляются
+			if ((size_t)res < frags[i].len)
+				break;
+		}
+
+		return done;
+	}
+
 	virtual int WriteByte(char c) = 0;
 
 	virtual int ReadByte(char *c, size_t timeoutMs) = 0;
+
+	/**
+	 * Передача данных, накопленных реализацией потока.
+	 *
+	 * @return 0 или отрицательный код ошибки
+	 */
+	virtual int Flush() {
+		return 0;
+	}
+
+	/**
+	 * Ожидание фактической передачи всех записанных данных.
+	 * Необходимо перед сменой скорости и по завершении передачи.
+	 *
+	 * @return 0 или отрицательный код ошибки
+	 */
+	virtual int Drain() {
+		return Flush();
+	}
+
+	/**
+	 * Смена скорости канала (если поддерживается транспортом).
+	 *
+	 * @return 0 или отрицательный код ошибки (-ENOTSUP)
+	 */
+	virtual int SetSpeed(uint32_t /* baud */) {
+		return -ENOTSUP;
+	}
+
+	/**
+	 * Ограничение ожидания готовности потока к записи (если поддерживается):
+	 * по истечении запись возвращает -EAGAIN, 0 - без ожидания.
+	 *
+	 * @return Прежнее значение
+	 */
+	virtual size_t SetWriteTimeout(size_t /* timeoutMs */) {
+		return 0;
+	}
+
+	/**
+	 * @return Текущая скорость канала, бит/с, или 0, если не определена
+	 */
+	virtual uint32_t GetSpeed() {
+		return 0;
+	}
+
+	/**
+	 * @return Количество асинхронных записей, которые могут находиться
+	 *         в обработке одновременно (0 - асинхронная запись не поддерживается)
+	 */
+	virtual size_t AsyncDepth() {
+		return 0;
+	}
+
+	/**
+	 * Асинхронная запись (DMA и т.п.).
+	 *
+	 * Буфер должен оставаться неизменным до вызова done. Записи передаются
+	 * и завершаются в порядке отправки. Drain ожидает завершения всех записей.
+	 *
+	 * @return 0 - запись принята, -EBUSY - заняты все AsyncDepth() мест,
+	 *         или отрицательный код ошибки
+	 */
+	virtual int WriteAsync(const char * /* p */, size_t /* len */, TWriteDone /* done */, void * /* ctx */) {
+		return -ENOTSUP;
+	}
+
+	/**
+	 * Ожидание, пока в обработке останется не более maxInFlight записей.
+	 * Обработчики завершения выполнены до возврата.
+	 *
+	 * @return 0 или отрицательный код ошибки (-ETIMEDOUT)
+	 */
+	virtual int WaitAsync(size_t /* maxInFlight */, size_t /* timeoutMs */) {
+		return 0;
+	}
+
+	/**
+	 * Чтение доступных байт.
+	 *
+	 * Ожидает первый байт не дольше timeoutMs, после чего возвращает
+	 * всё, что уже поступило (не более len).
+	 *
+	 * @return Количество прочитанных байт, 0 по таймауту
+	 *         или отрицательный код ошибки
+	 */
+	virtual int Read(char *p, size_t len, size_t timeoutMs) {
+		size_t n;
+		int res;
+
+		if (len == 0)
+			return 0;
+
+		res = ReadByte(p, timeoutMs);
+		if (res <= 0)
+			return res;
+
+		// Дочитывание уже поступивших байт без ожидания
+		for (n = 1; n < len; n++)
+			if (ReadByte(&p[n], 0) <= 0)
+				break;
+
+		return n;
+	}
 };
 
 
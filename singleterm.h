@@ -9,23 +9,24 @@
 #include "terminal.h"
 
 
+/**
+ * Упрощённый терминал: вывод без очереди, посимвольно в поток.
+ * Методы Puts/Gets/Putc/Getc скрывают одноимённые методы Terminal,
+ * история введённых строк - общая с Terminal (GetHistory).
+ */
 class SingleTerminal : public Terminal {
-public:
-	static const size_t MAX_INPUT_LEN = 64;
-	static const size_t HISTORY_SIZE = 5;
-
 public:
 	SingleTerminal(ParallelStream &a_stream)
 	:
-	Terminal(historyInputs, HISTORY_SIZE),
+	Terminal(a_stream),
 	stream(a_stream)
 	{
-		for (int i = 0; i < HISTORY_SIZE; i++)
-			historyInputs[i] = historyBuffers[i];
+		term.xpos = 0;
+		term.ypos = 0;
 	}
 
 public:
-	void Puts(const char *s) final {
+	void Puts(const char *s) {
 		char c;
 		size_t len = strlen(s);
 
@@ -33,7 +34,7 @@ public:
 			c = s[i];
 			Putc(s[i]);
 
-			switch (ansi.Decode(c)) {
+			switch (ansiOut.Decode(c)) {
 				case ANSI::KEY_END_LINE:
 					break;
 
@@ -52,19 +53,19 @@ public:
 					break;
 
 				case ANSI::KEY_UP:
-					term.ypos -= ansi.GetNum(0);
+					term.ypos -= ansiOut.GetNum(0);
 					break;
 
 				case ANSI::KEY_DOWN:
-					term.ypos += ansi.GetNum(0);
+					term.ypos += ansiOut.GetNum(0);
 					break;
 
 				case ANSI::KEY_RIGHT:
-					term.xpos += ansi.GetNum(0);
+					term.xpos += ansiOut.GetNum(0);
 					break;
 
 				case ANSI::KEY_LEFT:
-					term.xpos -= ansi.GetNum(0);
+					term.xpos -= ansiOut.GetNum(0);
 					break;
 
 				default:
@@ -76,7 +77,8 @@ public:
 		}
 	}
 
-	char * Gets(char *s) final {
+	// Строка обрезается до len - 1 символов
+	char * Gets(char *s, size_t len) {
 		char c;
 		char tmp[32];
 		const char *tmpP;
@@ -87,6 +89,8 @@ public:
 		size_t size = 0;
 		int histSelected = -1;
 
+		THistory &history = GetHistory();
+
 		int tabCnt = 0;
 
 		while (1) {
@@ -98,8 +102,11 @@ public:
 			c = (char)res;
 			printf("In:  \\%03o 0x%02x '%c'\n", (unsigned char)c, (unsigned char)c, (unsigned char)c);
 
-			switch (ansi.Decode(c)) {
+			switch (ansiIn.Decode(c)) {
 				case ANSI::NONE: {
+					if (size + 1 >= len)
+						break;
+
 					Putc(c);
 					// 1234
 					// size=4, pos=2
@@ -128,7 +135,7 @@ public:
 				case ANSI::KEY_NEW_LINE:
 				case ANSI::KEY_RETURN: {
 					s[size] = '\0';
-					historyPush(s);
+					history.Push(s);
 
 					return s;
 				}
@@ -220,12 +227,11 @@ public:
 				}
 
 				case ANSI::KEY_UP: {
-					if (histSelected == HISTORY_SIZE)
+					tmpP = history.Get(histSelected + 1);
+					if ((tmpP == nullptr) || (strlen(tmpP) >= len))
 						break;
 
-					tmpP = historyGet(++histSelected);
-					if (tmpP == nullptr)
-						break;
+					histSelected++;
 
 					if (pos > 0) {
 						sprintf(tmp, "\033[%dD", pos);
@@ -235,6 +241,7 @@ public:
 					Puts(tmpP);
 
 					size = strlen(tmpP);
+					memcpy(s, tmpP, size);
 					pos = size;
 
 					break;
@@ -254,10 +261,12 @@ public:
 						pos = 0;
 
 					} else if (histSelected > 0) {
-						tmpP = historyGet(--histSelected);
-						if (tmpP == nullptr)
+						tmpP = history.Get(histSelected - 1);
+						if ((tmpP == nullptr) || (strlen(tmpP) >= len))
 							break;
 
+						histSelected--;
+
 						if (pos > 0) {
 							sprintf(tmp, "\033[%dD", pos);
 							Puts(tmp);
@@ -266,6 +275,7 @@ public:
 						Puts(tmpP);
 
 						size = strlen(tmpP);
+						memcpy(s, tmpP, size);
 						pos = size;
 					}
 
@@ -279,7 +289,7 @@ public:
 		}
 	}
 
-	void Putc(char c) final {
+	void Putc(char c) {
 		//printf("Out: \\%03o 0x%02x '%c'\n", (unsigned char)c, (unsigned char)c, (unsigned char)c);
 		stream.WriteByte(c);
 	}
@@ -303,9 +313,13 @@ public:
 private:
 	ParallelStream &stream;
 
-	// TODO: Нужно поработать над реализацией истории
-	char *historyInputs[HISTORY_SIZE];
-	char historyBuffers[HISTORY_SIZE][MAX_INPUT_LEN];
+	ANSI ansiIn;
+	ANSI ansiOut;
+
+	struct {
+		int xpos;
+		int ypos;
+	} term;
 };
 
 
@@ -0,0 +1,101 @@
+#ifndef __SPSC_RING_H__
+#define __SPSC_RING_H__
+
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+
+/**
+ * Кольцевой буфер байт для одного писателя и одного читателя.
+ *
+ * Без блокировок и ожиданий: писатель изменяет только head, читатель - только tail.
+ * Подходит для передачи данных из потока/прерывания приёма в основной цикл.
+ *
+ * @tparam N Размер буфера, степень двойки
+ */
+template <size_t N>
+class SpscRing {
+	static_assert((N != 0) && ((N & (N - 1)) == 0), "SpscRing size must be a power of two");
+
+public:
+	SpscRing()
+	:
+	head(0),
+	tail(0)
+	{}
+
+	/**
+	 * Запись (только писатель).
+	 *
+	 * @return Количество записанных байт (меньше len, если буфер заполнен)
+	 */
+	size_t Push(const char *p, size_t len) {
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t t = tail.load(std::memory_order_acquire);
+		size_t free = N - (h - t);
+		size_t first;
+
+		if (len > free)
+			len = free;
+
+		first = N - (h & (N - 1));
+		if (first > len)
+			first = len;
+
+		memcpy(&buff[h & (N - 1)], p, first);
+		memcpy(buff, &p[first], len - first);
+
+		head.store(h + len, std::memory_order_release);
+		return len;
+	}
+
+	/**
+	 * Чтение (только читатель).
+	 *
+	 * @return Количество прочитанных байт
+	 */
+	size_t Pop(char *p, size_t len) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t h = head.load(std::memory_order_acquire);
+		size_t used = h - t;
+		size_t first;
+
+		if (len > used)
+			len = used;
+
+		first = N - (t & (N - 1));
+		if (first > len)
+			first = len;
+
+		memcpy(p, &buff[t & (N - 1)], first);
+		memcpy(&p[first], buff, len - first);
+
+		tail.store(t + len, std::memory_order_release);
+		return len;
+	}
+
+	size_t Size() const {
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+
+	bool Empty() const {
+		return Size() == 0;
+	}
+
+	static constexpr size_t Capacity() {
+		return N;
+	}
+
+private:
+	// Индексы не ограничиваются размером буфера, позиция - (индекс & (N - 1)).
+	// Разные строки кэша - без ложного разделения между писателем и читателем.
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+
+	char buff[N];
+};
+
+
+
+#endif /* __SPSC_RING_H__ */
@@ -0,0 +1,246 @@
+#ifndef __ASYNC_WRITE_STREAM_H__
+#define __ASYNC_WRITE_STREAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "paralstream.h"
+
+
+/**
+ * Асинхронная запись через отдельный поток выполнения.
+ *
+ * Эталон для отладки и измерений на ПК: поток записи играет роль DMA,
+ * обработчик завершения вызывается из него. Вложенный поток должен допускать
+ * одновременные чтение и запись (FdStream и производные).
+ * Чтение и прочие методы передаются вложенному потоку без изменений.
+ *
+ * Синхронные запись и Flush ожидают завершения асинхронных записей
+ * не дольше таймаута записи (SetWriteTimeout); он же передаётся вложенному
+ * потоку для синхронной записи, когда поток записи простаивает.
+ */
+class AsyncWriteStream : public ParallelStream {
+public:
+	static const size_t DEPTH = 2;
+
+public:
+	AsyncWriteStream(ParallelStream &a_inner)
+	:
+	inner(a_inner),
+	head(0),
+	count(0),
+	stop(false),
+	dirty(false)
+	{
+		// Таймаут записи вложенного потока (сохраняется - меняется только на время синхронной записи)
+		innerTimeoutMs = inner.SetWriteTimeout(0);
+		inner.SetWriteTimeout(innerTimeoutMs);
+		writeTimeoutMs = innerTimeoutMs;
+
+		writer = std::thread(&AsyncWriteStream::writerLoop, this);
+	}
+
+	~AsyncWriteStream() {
+		WaitAsync(0, SIZE_MAX);
+
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+			stop = true;
+		}
+		submitted.notify_one();
+		writer.join();
+	}
+
+	size_t AsyncDepth() final {
+		return DEPTH;
+	}
+
+	int WriteAsync(const char *p, size_t len, TWriteDone done, void *ctx) final {
+		{
+			std::lock_guard<std::mutex> lock(mtx);
+
+			if (count == DEPTH)
+				return -EBUSY;
+
+			queue[(head + count) % DEPTH] = {p, len, done, ctx};
+			count++;
+		}
+
+		submitted.notify_one();
+		return 0;
+	}
+
+	int WaitAsync(size_t maxInFlight, size_t timeoutMs) final {
+		std::unique_lock<std::mutex> lock(mtx);
+		auto pred = [&]() { return count <= maxInFlight; };
+
+		if (timeoutMs == SIZE_MAX) {
+			completed.wait(lock, pred);
+			return 0;
+		}
+
+		return completed.wait_for(lock, std::chrono::milliseconds(timeoutMs), pred) ? 0 : -ETIMEDOUT;
+	}
+
+	// Синхронная запись выполняется после завершения отправленных асинхронных
+	int Write(const char *p, size_t len) final {
+		int res = beginSync();
+		return (res < 0) ? res : inner.Write(p, len);
+	}
+
+	int WriteV(const Fragment_t *frags, size_t n) final {
+		int res = beginSync();
+		return (res < 0) ? res : inner.WriteV(frags, n);
+	}
+
+	int WriteByte(char c) final {
+		return Write(&c, 1);
+	}
+
+	int ReadByte(char *c, size_t timeoutMs) final {
+		return inner.ReadByte(c, timeoutMs);
+	}
+
+	int Read(char *p, size_t len, size_t timeoutMs) final {
+		return inner.Read(p, len, timeoutMs);
+	}
+
+	// Поток записи сам выполняет Flush после опустошения очереди; здесь - только
+	// после синхронной записи
+	int Flush() final {
+		int res;
+
+		if (!dirty)
+			return 0;
+
+		if ((res = beginSync()) < 0)
+			return res;
+
+		dirty = false;
+		return inner.Flush();
+	}
+
+	int Drain() final {
+		WaitAsync(0, SIZE_MAX);
+		inner.SetWriteTimeout(innerTimeoutMs);
+		dirty = false;
+		return inner.Drain();
+	}
+
+	size_t SetWriteTimeout(size_t timeoutMs) final {
+		size_t prev = writeTimeoutMs;
+
+		writeTimeoutMs = timeoutMs;
+		return prev;
+	}
+
+	int SetSpeed(uint32_t baud) final {
+		int res = Drain();
+		return (res < 0) ? res : inner.SetSpeed(baud);
+	}
+
+	uint32_t GetSpeed() final {
+		return inner.GetSpeed();
+	}
+
+private:
+	typedef struct {
+		const char *p;
+		size_t len;
+		TWriteDone done;
+		void *ctx;
+	} Request_t;
+
+private:
+	// Ожидание завершения асинхронных записей перед синхронной: вложенный поток
+	// используется только простаивающим потоком записи или вызывающим
+	int beginSync() {
+		if (WaitAsync(0, writeTimeoutMs) < 0)
+			return -EAGAIN;
+
+		inner.SetWriteTimeout(writeTimeoutMs);
+		dirty = true;
+		return 0;
+	}
+
+	void writerLoop() {
+		Request_t req;
+		size_t done;
+		bool last;
+		int res;
+
+		while (1) {
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				submitted.wait(lock, [&]() { return stop || (count > 0); });
+
+				if (count == 0)
+					return;
+
+				// Запрос остаётся в очереди до завершения - учитывается в WaitAsync
+				req = queue[head];
+			}
+
+			inner.SetWriteTimeout(innerTimeoutMs);
+
+			for (done = 0, res = 0; done < req.len; done += res) {
+				res = inner.Write(&req.p[done], req.len - done);
+				if (res == -EAGAIN)
+					res = 0;
+				else if (res <= 0) {
+					res = (res < 0) ? res : -EIO;
+					break;
+				}
+			}
+
+			if (res >= 0)
+				res = done;
+
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				last = (count == 1);
+			}
+
+			if (last)
+				inner.Flush();
+
+			// Обработчик - до удаления запроса: после WaitAsync он уже выполнен
+			if (req.done)
+				req.done(req.ctx, res);
+
+			{
+				std::lock_guard<std::mutex> lock(mtx);
+				head = (head + 1) % DEPTH;
+				count--;
+			}
+			completed.notify_all();
+		}
+	}
+
+
+private:
+	ParallelStream &inner;
+
+	std::mutex mtx;
+	std::condition_variable submitted;
+	std::condition_variable completed;
+	std::thread writer;
+
+	Request_t queue[DEPTH];
+	size_t head;
+	size_t count;
+	bool stop;
+
+	size_t innerTimeoutMs;		// Таймаут вложенного потока для потока записи
+	size_t writeTimeoutMs;		// Таймаут синхронной записи и ожидания перед ней
+	bool dirty;					// Синхронная запись после последнего Flush
+};
+
+
+
+#endif /* __ASYNC_WRITE_STREAM_H__ */
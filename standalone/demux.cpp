@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+
+#include "spstream.h"
+#include "ptystream.h"
+#include "linkmux.h"
+
+
+/**
+ * Разделение каналов --mux на стороне ПК.
+ *
+ * Каждый канал выводится на отдельный псевдотерминал: консоль открывается
+ * в screen/picocom, передача файлов - в sz/rz, журнал - через cat.
+ */
+
+const char *CHANNEL_NAMES[CH_COUNT] = {"console", "log", "transfer"};
+
+volatile sig_atomic_t running = 1;
+
+void OnSignal(int) {
+	running = 0;
+}
+
+// Данные канала, ещё не принятые псевдотерминалом
+typedef struct {
+	char buff[LinkMux::MAX_PAYLOAD * 4];
+	size_t pos;
+	size_t len;
+} Pending_t;
+
+
+bool Writable(int fd) {
+	struct pollfd pfd = {.fd = fd, .events = POLLOUT, .revents = 0};
+	return (poll(&pfd, 1, 0) > 0) && (pfd.revents & POLLOUT);
+}
+
+
+int main(int argc, char *argv[]) {
+	const char *device = (argc > 1) ? argv[1] : "/dev/ttyUSB0";
+	uint32_t baud = (argc > 2) ? strtoul(argv[2], nullptr, 10) : 115200;
+
+	struct pollfd pfd[1 + CH_COUNT];
+	PtyStream pty[CH_COUNT];
+	Pending_t out[CH_COUNT] = {};
+	char buff[LinkMux::MAX_PAYLOAD * 4];
+	size_t len;
+	int res;
+
+	if ((argc > 3) || (baud == 0)) {
+		printf("Usage:\n"
+			   "\t%s [device] [baud]\n", argv[0]);
+		return 1;
+	}
+
+	SerialPortStream serial(device, baud, SerialPortStream::OPT_POLL_TIMEOUT | SerialPortStream::OPT_THROUGHPUT);
+	if (!serial.IsOpen())
+		return 1;
+
+	LinkMux mux(serial);
+	SetupLinkMux(mux);
+
+	for (size_t i = 0; i < CH_COUNT; i++) {
+		if (!pty[i].IsOpen())
+			return 1;
+		printf("%s: %s\n", CHANNEL_NAMES[i], pty[i].SlavePath());
+	}
+	fflush(stdout);
+
+	signal(SIGINT, OnSignal);
+	signal(SIGTERM, OnSignal);
+
+	while (running) {
+		pfd[0] = {.fd = serial.Fd(), .events = POLLIN, .revents = 0};
+
+		// Псевдотерминал читается, только если данные поместятся в буфер канала
+		for (size_t i = 0; i < CH_COUNT; i++)
+			pfd[1 + i] = {.fd = (mux.TxFree(i) > 0) ? pty[i].Fd() : -1, .events = POLLIN, .revents = 0};
+
+		res = poll(pfd, 1 + CH_COUNT, LinkMux::POLL_MS);
+		if ((res < 0) && (errno != EINTR))
+			break;
+
+		if ((res = mux.Poll(0)) < 0) {
+			printf("Link error: %s\n", strerror(-res));
+			break;
+		}
+
+		for (size_t i = 0; i < CH_COUNT; i++) {
+			// Псевдотерминал -> канал
+			len = (mux.TxFree(i) < sizeof(buff)) ? mux.TxFree(i) : sizeof(buff);
+			if ((pfd[1 + i].revents & POLLIN) && ((res = pty[i].Read(buff, len, 0)) > 0))
+				mux[i].Write(buff, res);
+
+			// Канал -> псевдотерминал. Пока клиент не читает, данные остаются в канале
+			// и передача с другой стороны останавливается кредитами. Не принятый
+			// псевдотерминалом остаток передаётся при следующей готовности.
+			while (Writable(pty[i].Fd())) {
+				if (out[i].pos == out[i].len) {
+					if ((res = mux[i].Read(out[i].buff, sizeof(out[i].buff), 0)) <= 0)
+						break;
+
+					out[i].pos = 0;
+					out[i].len = res;
+				}
+
+				if ((res = pty[i].Write(&out[i].buff[out[i].pos], out[i].len - out[i].pos)) <= 0)
+					break;
+
+				out[i].pos += res;
+			}
+		}
+	}
+
+	return 0;
+}
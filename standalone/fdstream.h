@@ -0,0 +1,230 @@
+#ifndef __FD_STREAM_H__
+#define __FD_STREAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "paralstream.h"
+
+
+/**
+ * Поток поверх файлового дескриптора (последовательный порт, PTY, сокет).
+ *
+ * Чтение с таймаутом выполняется через poll(), запись - с повтором
+ * при EINTR/EAGAIN и возвратом количества фактически записанных байт.
+ */
+class FdStream : public ParallelStream {
+public:
+	static const int WRITE_TIMEOUT_MS = 1000;
+
+public:
+	FdStream()
+	:
+	fd(-1),
+	writeTimeoutMs(WRITE_TIMEOUT_MS)
+	{}
+
+	virtual ~FdStream() {
+		if (fd >= 0)
+			close(fd);
+	}
+
+	int Fd() const {
+		return fd;
+	}
+
+	bool IsOpen() const {
+		return fd >= 0;
+	}
+
+	/**
+	 * Максимальное ожидание готовности неблокирующего дескриптора к записи.
+	 * По истечении запись возвращает -EAGAIN (0 - без ожидания).
+	 */
+	size_t SetWriteTimeout(size_t timeoutMs) override {
+		size_t prev = writeTimeoutMs;
+
+		writeTimeoutMs = (timeoutMs > INT_MAX) ? INT_MAX : timeoutMs;
+		return prev;
+	}
+
+	int Write(const char *p, size_t len) override {
+		return writeFd(p, len);
+	}
+
+	int WriteV(const Fragment_t *frags, size_t n) override {
+		struct iovec iov[IOV_BATCH];
+		size_t done = 0;
+		size_t batch;
+		size_t batchLen;
+		ssize_t res;
+
+		while (n > 0) {
+			batch = (n < IOV_BATCH) ? n : IOV_BATCH;
+			batchLen = 0;
+
+			for (size_t i = 0; i < batch; i++) {
+				iov[i].iov_base = (void *)frags[i].p;
+				iov[i].iov_len = frags[i].len;
+				batchLen += frags[i].len;
+			}
+
+			res = writev(fd, iov, batch);
+			if (res < 0) {
+				if (errno == EINTR)
+					continue;
+
+				res = (errno == EAGAIN) ? waitWritable() : -errno;
+				if (res == 0)
+					continue;
+
+				return (done > 0) ? done : res;
+			}
+
+			done += res;
+
+			if ((size_t)res < batchLen)
+				break;
+
+			frags += batch;
+			n -= batch;
+		}
+
+		return done;
+	}
+
+	int WriteByte(char c) override {
+		return Write(&c, 1);
+	}
+
+	int ReadByte(char *c, size_t timeoutMs) override {
+		return Read(c, 1, timeoutMs);
+	}
+
+	int Read(char *p, size_t len, size_t timeoutMs) override {
+		return pollRead(p, len, timeoutMs);
+	}
+
+	/**
+	 * Передача данных из файла без копирования через память процесса:
+	 * sendfile(), для канала (pipe) - splice(). Данные, накопленные потоком,
+	 * должны быть переданы заранее (Flush).
+	 *
+	 * @return Количество переданных байт (0 - конец файла), -EINVAL - передача
+	 *         из inFd без копирования невозможна, иначе отрицательный код ошибки
+	 */
+	int SendFile(int inFd, size_t len) {
+		ssize_t res;
+
+		if (len > INT_MAX)
+			len = INT_MAX;
+
+		while (1) {
+			res = sendfile(fd, inFd, nullptr, len);
+			if ((res < 0) && (errno == EINVAL))
+				res = splice(inFd, nullptr, fd, nullptr, len, SPLICE_F_MOVE);
+
+			if (res >= 0)
+				return res;
+
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN) {
+				if ((res = waitWritable()) < 0)
+					return res;
+				continue;
+			}
+
+			return -errno;
+		}
+	}
+
+protected:
+	static const size_t IOV_BATCH = 64;
+
+	int fd;
+	int writeTimeoutMs;
+
+	// Ожидание готовности дескриптора к записи после EAGAIN
+	int waitWritable() {
+		struct pollfd pfd = {.fd = fd, .events = POLLOUT, .revents = 0};
+		int res;
+
+		do {
+			res = poll(&pfd, 1, writeTimeoutMs);
+		} while ((res < 0) && (errno == EINTR));
+
+		if (res == 0)
+			return -EAGAIN;
+		return (res < 0) ? -errno : 0;
+	}
+
+	// write() с повтором при EINTR/EAGAIN. Возвращает количество записанных байт
+	// (возможно меньше len) или отрицательный код ошибки.
+	int writeFd(const char *p, size_t len) {
+		ssize_t res;
+
+		while (1) {
+			res = write(fd, p, len);
+			if (res >= 0)
+				return res;
+
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN) {
+				if ((res = waitWritable()) < 0)
+					return res;
+				continue;
+			}
+
+			return -errno;
+		}
+	}
+
+	// Чтение с таймаутом через poll(). Дескриптор должен быть неблокирующим
+	// (O_NONBLOCK или VMIN = 0, VTIME = 0).
+	int pollRead(char *p, size_t len, size_t timeoutMs) {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+		int res;
+
+		// Данные уже в буфере драйвера - без лишнего poll()
+		res = read(fd, p, len);
+		if (res > 0)
+			return res;
+		else if ((res < 0) && (errno != EAGAIN))
+			return -errno;
+
+		if (timeoutMs == 0)
+			return 0;
+
+		if (timeoutMs > INT_MAX)
+			timeoutMs = INT_MAX;
+
+		res = poll(&pfd, 1, (int)timeoutMs);
+		if (res == 0)
+			return 0;
+		else if (res < 0)
+			return (errno == EINTR) ? 0 : -errno;
+
+		res = read(fd, p, len);
+		if (res < 0)
+			return (errno == EAGAIN) ? 0 : -errno;
+
+		return res;
+	}
+};
+
+
+
+#endif /* __FD_STREAM_H__ */
@@ -0,0 +1,524 @@
+#ifndef __FILE_HISTORY_H__
+#define __FILE_HISTORY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "history.h"
+
+
+/**
+ * История в файле, общая для всех запущенных экземпляров.
+ *
+ * Файл только дополняется записями и отображается в память. При открытии
+ * он не разбирается: строки находятся от конца файла по мере просмотра,
+ * индекс смещений пополняется лениво - время до первого приглашения
+ * не зависит от размера истории.
+ *
+ * Запись: длина (uint32), строка с '\0', сигнатура для поиска
+ * (history::Signature, uint64), длина - обход в обоих направлениях
+ * без отдельного файла индекса.
+ *
+ * Экземпляры дописывают записи под flock(LOCK_EX). Записи других экземпляров
+ * читаются (под LOCK_SH) при обращении к новейшей строке - в начале
+ * просмотра и поиска. Файл больше COMPACT_SIZE сжимается в фоновом потоке:
+ * новейшие неповторяющиеся строки переписываются в новый файл, который
+ * заменяет прежний (rename); экземпляры переоткрывают файл, обнаружив замену.
+ *
+ * Не потокобезопасен: один объект - на один терминал.
+ */
+class FileHistory : public HistoryStore {
+public:
+	static const uint32_t MAGIC = 0x31484d45;			// "EMH1"
+	static const size_t HEADER_SIZE = 8;				// MAGIC + резерв
+	static const size_t RECORD_EXTRA = 17;				// Длина, '\0', сигнатура, длина
+	static const size_t MAX_LINE = 4096;
+	static const size_t COMPACT_SIZE = 1 << 20;			// Размер файла, при котором выполняется сжатие
+	static const size_t KEEP_SIZE = COMPACT_SIZE / 4;	// Объём записей после сжатия
+
+public:
+	FileHistory(const char *a_path)
+	:
+	path(a_path),
+	fd(-1),
+	map(nullptr),
+	mapLen(0),
+	compacting(false)
+	{
+		int res = openFile();
+
+		if (res < 0)
+			printf("Error %i from opening history %s: %s\n", -res, a_path, strerror(-res));
+	}
+
+	~FileHistory() {
+		if (compactor.joinable())
+			compactor.join();
+
+		closeFile();
+	}
+
+	bool IsOpen() const {
+		return fd >= 0;
+	}
+
+	void Append(const char *s) final {
+		uint32_t len = strlen(s);
+		uint64_t sig;
+		const char *newest;
+		struct stat st;
+		ssize_t res;
+
+		if ((len == 0) || (len > MAX_LINE))
+			return;
+
+		// Повтор новейшей строки не сохраняется
+		if (((newest = Get(0)) != nullptr) && (strcmp(newest, s) == 0))
+			return;
+
+		sig = history::Signature(s);
+
+		const struct iovec rec[] = {
+				{&len, sizeof(len)},
+				{(void *)s, len + 1},
+				{&sig, sizeof(sig)},
+				{&len, sizeof(len)},
+		};
+
+		if (lockFile() < 0)
+			return;
+
+		// O_APPEND: запись целиком в конец файла. Не записанная целиком
+		// (нет места) удаляется.
+		if (fstat(fd, &st) == 0) {
+			while (((res = writev(fd, rec, 4)) < 0) && (errno == EINTR));
+
+			if (res != (ssize_t)(len + RECORD_EXTRA))
+				ftruncate(fd, st.st_size);
+		}
+
+		flock(fd, LOCK_UN);
+
+		refresh();
+
+		if ((end > COMPACT_SIZE) && !compacting.load())
+			startCompaction();
+	}
+
+	const char * Get(size_t n) final {
+		uint64_t off = offset(n);
+
+		return (off != 0) ? &map[off + 4] : nullptr;
+	}
+
+	size_t Find(const char *q, size_t n, bool back) final {
+		uint64_t sig = history::Signature(q);
+		uint64_t off;
+
+		// К более новым - до n = 0, затем n переполняется и становится NOT_FOUND
+		for (; n != history::NOT_FOUND; n = back ? n + 1 : n - 1) {
+			if ((off = offset(n)) == 0)
+				break;
+
+			if (((u64(map, off + 5 + u32(map, off)) & sig) == sig) && (strstr(&map[off + 4], q) != nullptr))
+				return n;
+		}
+
+		return history::NOT_FOUND;
+	}
+
+private:
+	static uint32_t u32(const char *map, uint64_t off) {
+		uint32_t v;
+		memcpy(&v, &map[off], sizeof(v));
+		return v;
+	}
+
+	static uint64_t u64(const char *map, uint64_t off) {
+		uint64_t v;
+		memcpy(&v, &map[off], sizeof(v));
+		return v;
+	}
+
+	// Начало записи, заканчивающейся в pos; 0 - начало файла или повреждённая запись
+	static uint64_t recordBefore(const char *map, uint64_t pos) {
+		uint64_t start;
+		uint32_t len;
+
+		if (pos < HEADER_SIZE + RECORD_EXTRA)
+			return 0;
+
+		len = u32(map, pos - 4);
+		if (len > pos - HEADER_SIZE - RECORD_EXTRA)
+			return 0;
+
+		start = pos - len - RECORD_EXTRA;
+		if ((u32(map, start) != len) || (map[start + 4 + len] != '\0'))
+			return 0;
+
+		return start;
+	}
+
+	// Конец записи, начинающейся в pos; 0 - незавершённая или повреждённая запись
+	static uint64_t recordAfter(const char *map, uint64_t pos, uint64_t size) {
+		uint64_t recEnd;
+		uint32_t len;
+
+		if (size - pos < RECORD_EXTRA)
+			return 0;
+
+		len = u32(map, pos);
+		if (len > size - pos - RECORD_EXTRA)
+			return 0;
+
+		recEnd = pos + len + RECORD_EXTRA;
+		if ((u32(map, recEnd - 4) != len) || (map[pos + 4 + len] != '\0'))
+			return 0;
+
+		return recEnd;
+	}
+
+	// Запись в start действительно целая: строка без '\0' внутри, сигнатура совпадает
+	static bool intact(const char *map, uint64_t start) {
+		uint32_t len = u32(map, start);
+
+		return (memchr(&map[start + 4], '\0', len) == nullptr) &&
+			   (u64(map, start + 5 + len) == history::Signature(&map[start + 4]));
+	}
+
+	// Конец последней целой записи перед повреждённым участком, заканчивающимся в pos;
+	// 0 - целых записей до pos нет
+	static uint64_t resyncBefore(const char *map, uint64_t pos) {
+		uint64_t start;
+
+		for (pos--; pos >= HEADER_SIZE + RECORD_EXTRA; pos--)
+			if (((start = recordBefore(map, pos)) != 0) && intact(map, start))
+				return pos;
+
+		return 0;
+	}
+
+	// Начало записи перед pos; повреждённый участок (незавершённая запись аварийно
+	// завершённого экземпляра) пропускается. 0 - записей до pos нет.
+	static uint64_t previous(const char *map, uint64_t pos) {
+		uint64_t start = recordBefore(map, pos);
+
+		if ((start == 0) && (pos > HEADER_SIZE) && ((pos = resyncBefore(map, pos)) != 0))
+			start = recordBefore(map, pos);
+
+		return start;
+	}
+
+	// Незавершённая запись в конце файла удаляется. Выполняется под LOCK_EX.
+	int truncateTail(struct stat &st) {
+		uint64_t pos = st.st_size;
+
+		if ((pos == HEADER_SIZE) || (recordBefore(map, pos) != 0))
+			return 0;
+
+		if ((pos = resyncBefore(map, pos)) == 0)
+			pos = HEADER_SIZE;
+
+		if (ftruncate(fd, pos) < 0)
+			return -errno;
+
+		st.st_size = pos;
+		return mapFile(pos);
+	}
+
+	int openFile() {
+		struct stat st;
+		uint32_t hdr[2] = {MAGIC, 0};
+		int res = 0;
+
+		fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+		if (fd < 0)
+			return -errno;
+
+		// Заголовок нового файла; незавершённая запись в конце удаляется
+		flock(fd, LOCK_EX);
+		if (fstat(fd, &st) < 0)
+			res = -errno;
+		else if ((st.st_size == 0) && (write(fd, hdr, sizeof(hdr)) != sizeof(hdr)))
+			res = -EIO;
+		else if ((pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) || (hdr[0] != MAGIC))
+			res = -EINVAL;
+		else if (fstat(fd, &st) < 0)
+			res = -errno;
+		else if ((res = mapFile(st.st_size)) == 0)
+			res = truncateTail(st);
+		flock(fd, LOCK_UN);
+
+		if (res == 0) {
+			dev = st.st_dev;
+			ino = st.st_ino;
+
+			base = end = st.st_size;
+			older.clear();
+			newer.clear();
+			return 0;
+		}
+
+		closeFile();
+		return res;
+	}
+
+	void closeFile() {
+		if (map != nullptr)
+			munmap((void *)map, mapLen);
+
+		if (fd >= 0)
+			close(fd);
+
+		fd = -1;
+		map = nullptr;
+		mapLen = 0;
+	}
+
+	int mapFile(size_t size) {
+		void *p;
+
+		if ((map != nullptr) && (size == mapLen))
+			return 0;
+
+		if (map != nullptr)
+			munmap((void *)map, mapLen);
+
+		map = nullptr;
+		mapLen = 0;
+
+		p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			return -errno;
+
+		map = (const char *)p;
+		mapLen = size;
+		return 0;
+	}
+
+	// Файл заменён сжатием (или удалён)
+	bool replaced() const {
+		struct stat st;
+
+		return (stat(path.c_str(), &st) < 0) || (st.st_ino != ino) || (st.st_dev != dev);
+	}
+
+	// Блокировка для дописывания: файл, заменённый сжатием, переоткрывается
+	int lockFile() {
+		for (int i = 0; i < 3; i++) {
+			if (fd < 0)
+				return -EBADF;
+
+			if (flock(fd, LOCK_EX) < 0)
+				return -errno;
+
+			if (!replaced())
+				return 0;
+
+			flock(fd, LOCK_UN);
+			closeFile();
+			openFile();
+		}
+
+		return -EAGAIN;
+	}
+
+	// Приём записей, добавленных после последнего обращения (в том числе другими экземплярами)
+	void refresh() {
+		struct stat st;
+		uint64_t pos;
+		uint64_t recEnd;
+
+		if ((fd >= 0) && replaced()) {
+			closeFile();
+			openFile();
+		}
+
+		if ((fd < 0) || (fstat(fd, &st) < 0) || ((uint64_t)st.st_size == end))
+			return;
+
+		// Файл усечён извне - индекс недействителен
+		if ((uint64_t)st.st_size < end) {
+			closeFile();
+			openFile();
+			return;
+		}
+
+		// Записи дописываются под LOCK_EX: под LOCK_SH размер файла - граница целых записей
+		flock(fd, LOCK_SH);
+		fstat(fd, &st);
+		int res = mapFile(st.st_size);
+		flock(fd, LOCK_UN);
+
+		if (res < 0) {
+			closeFile();
+			return;
+		}
+
+		for (pos = end; pos < (uint64_t)st.st_size; pos = recEnd) {
+			if ((recEnd = recordAfter(map, pos, st.st_size)) == 0) {
+				// Повреждённая запись (аварийное завершение экземпляра) -
+				// строки снова ищутся от конца файла
+				base = st.st_size;
+				older.clear();
+				newer.clear();
+				break;
+			}
+
+			newer.push_back(pos);
+		}
+
+		end = st.st_size;
+	}
+
+	// Смещение записи строки n (0 - новейшая) или 0, если строки нет
+	uint64_t offset(size_t n) {
+		uint64_t start;
+
+		if (n == 0)
+			refresh();
+
+		if (map == nullptr)
+			return 0;
+
+		if (n < newer.size())
+			return newer[newer.size() - 1 - n];
+
+		n -= newer.size();
+
+		// Записи до base индексируются от конца к началу по мере обращения
+		while (older.size() <= n) {
+			if ((start = previous(map, older.empty() ? base : older.back())) == 0)
+				return 0;
+
+			older.push_back(start);
+		}
+
+		return older[n];
+	}
+
+	void startCompaction() {
+		if (compacting.exchange(true))
+			return;
+
+		if (compactor.joinable())
+			compactor.join();
+
+		compactor = std::thread([this, p = path]() {
+			compact(p);
+			compacting.store(false);
+		});
+	}
+
+	// Сжатие: новейшие неповторяющиеся строки объёмом до KEEP_SIZE - в новый файл
+	static int compact(const std::string &path) {
+		std::unordered_set<std::string_view> seen;
+		std::vector<uint64_t> keep;
+		std::string out;
+		std::string tmpPath = path + ".tmp";
+		struct stat st;
+		struct stat cur;
+		const char *m;
+		uint64_t pos;
+		uint64_t start;
+		size_t total = 0;
+		uint32_t hdr[2] = {MAGIC, 0};
+		int res = 0;
+		int fd;
+		int tmp;
+
+		fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -errno;
+
+		// Дописывание останавливается до замены файла
+		flock(fd, LOCK_EX);
+
+		// Файл уже сжат другим экземпляром
+		if ((fstat(fd, &st) < 0) || (stat(path.c_str(), &cur) < 0) ||
+				(cur.st_ino != st.st_ino) || ((size_t)st.st_size <= COMPACT_SIZE)) {
+			close(fd);
+			return 0;
+		}
+
+		m = (const char *)mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (m == MAP_FAILED) {
+			res = -errno;
+			close(fd);
+			return res;
+		}
+
+		for (pos = st.st_size; (start = previous(m, pos)) != 0; pos = start) {
+			std::string_view line(&m[start + 4], u32(m, start));
+			size_t size = line.size() + RECORD_EXTRA;
+
+			if (total + size > KEEP_SIZE)
+				break;
+
+			if (seen.insert(line).second) {
+				keep.push_back(start);
+				total += size;
+			}
+		}
+
+		out.reserve(HEADER_SIZE + total);
+		out.append((const char *)hdr, sizeof(hdr));
+		for (size_t i = keep.size(); i-- > 0;)
+			out.append(&m[keep[i]], u32(m, keep[i]) + RECORD_EXTRA);
+
+		tmp = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (tmp < 0)
+			res = -errno;
+		else {
+			if ((write(tmp, out.data(), out.size()) != (ssize_t)out.size()) || (fsync(tmp) < 0))
+				res = -EIO;
+			close(tmp);
+
+			if ((res == 0) && (rename(tmpPath.c_str(), path.c_str()) < 0))
+				res = -errno;
+			if (res < 0)
+				unlink(tmpPath.c_str());
+		}
+
+		munmap((void *)m, st.st_size);
+		close(fd);
+		return res;
+	}
+
+
+private:
+	std::string path;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+
+	const char *map;
+	size_t mapLen;
+
+	uint64_t base;					// Конец файла при открытии: более старые строки - до него
+	uint64_t end;					// Конец принятых записей
+	std::vector<uint64_t> older;	// Записи до base, от новейшей
+	std::vector<uint64_t> newer;	// Записи после base, от самой старой
+
+	std::thread compactor;
+	std::atomic<bool> compacting;
+};
+
+
+
+#endif /* __FILE_HISTORY_H__ */
@@ -0,0 +1,343 @@
+#ifndef __LINK_EMULATION_STREAM_H__
+#define __LINK_EMULATION_STREAM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "paralstream.h"
+#include "clock.h"
+
+
+/**
+ * Эмуляция канала связи поверх другого потока.
+ *
+ * В обоих направлениях:
+ *  - ограничение скорости передачи (baud, 8N1 - 10 бит на байт);
+ *  - фиксированная задержка в одну сторону + случайная добавка (jitter);
+ *  - потеря байт и инверсия одного бита с заданной вероятностью.
+ *
+ * Случайные события детерминированы начальным значением seed, время доставки
+ * отсчитывается по часам clock (с VirtualClock - без реального ожидания).
+ * Задержанные данные передаются во время вызовов методов потока
+ * (Read/Write/Flush/Drain), отдельный поток выполнения не требуется.
+ */
+class LinkEmuStream : public ParallelStream {
+public:
+	static const size_t QUEUE_SIZE = 4096;
+	static const size_t CHUNK_SIZE = 256;
+	static const uint32_t BITS_PER_BYTE = 10;
+	static const uint32_t PPM = 1000000;
+
+	typedef struct {
+		uint32_t baud;			// Скорость, бит/с (0 - без ограничения)
+		uint32_t latencyUs;		// Задержка в одну сторону, мкс
+		uint32_t jitterUs;		// Максимальная случайная добавка к задержке, мкс
+		uint32_t dropPpm;		// Вероятность потери байта, на миллион
+		uint32_t flipPpm;		// Вероятность инверсии бита в байте, на миллион
+		uint32_t seed;			// Начальное значение генератора случайных чисел
+	} Config_t;
+
+	typedef struct {
+		uint64_t txBytes;
+		uint64_t rxBytes;
+		uint64_t dropped;
+		uint64_t flipped;
+	} Stats_t;
+
+public:
+	LinkEmuStream(ParallelStream &a_inner, const Config_t &a_cfg, Clock &a_clock = MonotonicClock::Instance())
+	:
+	inner(a_inner),
+	cfg(a_cfg),
+	clock(a_clock),
+	writeTimeoutMs(SIZE_MAX)
+	{
+		rnd = cfg.seed ? cfg.seed : 1;
+		byteTimeNs = cfg.baud ? (BITS_PER_BYTE * 1000000000ull) / cfg.baud : 0;
+
+		tx.head = tx.count = 0;
+		tx.lineFreeAt = tx.lastDue = 0;
+		rx.head = rx.count = 0;
+		rx.lineFreeAt = rx.lastDue = 0;
+
+		stats = {0, 0, 0, 0};
+	}
+
+	// Очередь заполнена дольше таймаута записи - число принятых байт или -EAGAIN
+	int Write(const char *p, size_t len) final {
+		uint64_t deadline = deadlineNs(writeTimeoutMs);
+		uint64_t due;
+		int res;
+
+		for (size_t i = 0; i < len; i++) {
+			// Очередь передачи заполнена - ожидание освобождения линии
+			while (tx.count == QUEUE_SIZE) {
+				if ((res = deliverTx(nowNs())) < 0)
+					return (i > 0) ? i : res;
+				if (tx.count < QUEUE_SIZE)
+					break;
+
+				if (nowNs() >= deadline)
+					return (i > 0) ? i : -EAGAIN;
+
+				due = tx.buff[tx.head].due;
+				if ((res = waitUntil((due < deadline) ? due : deadline)) < 0)
+					return (i > 0) ? i : res;
+			}
+
+			enqueue(tx, p[i], nowNs());
+			stats.txBytes++;
+		}
+
+		res = deliverTx(nowNs());
+		return (res < 0) ? res : len;
+	}
+
+	int WriteByte(char c) final {
+		return Write(&c, 1);
+	}
+
+	int ReadByte(char *c, size_t timeoutMs) final {
+		return Read(c, 1, timeoutMs);
+	}
+
+	int Read(char *p, size_t len, size_t timeoutMs) final {
+		uint64_t deadline = nowNs() + timeoutMs * 1000000ull;
+		uint64_t now;
+		uint64_t next;
+		size_t n;
+		int res;
+
+		while (1) {
+			now = nowNs();
+
+			if ((res = deliverTx(now)) < 0)
+				return res;
+			if ((res = pullRx(0)) < 0)
+				return res;
+
+			// Выдача байт, "дошедших" до получателя
+			for (n = 0; (n < len) && (rx.count > 0) && (rx.buff[rx.head].due <= now); n++) {
+				p[n] = rx.buff[rx.head].c;
+				rx.head = (rx.head + 1) % QUEUE_SIZE;
+				rx.count--;
+			}
+
+			if (n > 0)
+				return n;
+
+			if (now >= deadline)
+				return 0;
+
+			next = deadline;
+			if ((rx.count > 0) && (rx.buff[rx.head].due < next))
+				next = rx.buff[rx.head].due;
+			if ((tx.count > 0) && (tx.buff[tx.head].due < next))
+				next = tx.buff[tx.head].due;
+
+			if ((res = waitUntil(next)) < 0)
+				return res;
+		}
+	}
+
+	int Flush() final {
+		int res = deliverTx(nowNs());
+		return (res < 0) ? res : inner.Flush();
+	}
+
+	int Drain() final {
+		int res;
+
+		while (tx.count > 0) {
+			if ((res = waitUntil(tx.buff[tx.head].due)) < 0)
+				return res;
+			if ((res = deliverTx(nowNs())) < 0)
+				return res;
+		}
+
+		return inner.Drain();
+	}
+
+	// Смена эмулируемой скорости; передаётся и вложенному потоку, если он её поддерживает
+	int SetSpeed(uint32_t baud) final {
+		int res = Drain();
+		if (res < 0)
+			return res;
+
+		res = inner.SetSpeed(baud);
+		if ((res < 0) && (res != -ENOTSUP))
+			return res;
+
+		cfg.baud = baud;
+		byteTimeNs = cfg.baud ? (BITS_PER_BYTE * 1000000000ull) / cfg.baud : 0;
+		return 0;
+	}
+
+	uint32_t GetSpeed() final {
+		return cfg.baud;
+	}
+
+	// Ожидание места в очереди передачи (по умолчанию - без ограничения).
+	// Вложенному потоку не передаётся: в него пишутся только "дошедшие" байты.
+	size_t SetWriteTimeout(size_t timeoutMs) final {
+		size_t prev = writeTimeoutMs;
+
+		writeTimeoutMs = timeoutMs;
+		return prev;
+	}
+
+	const Stats_t & Stats() const {
+		return stats;
+	}
+
+private:
+	typedef struct {
+		char c;
+		uint64_t due;			// Момент доставки получателю, нс
+	} Entry_t;
+
+	typedef struct {
+		Entry_t buff[QUEUE_SIZE];
+		size_t head;
+		size_t count;
+
+		uint64_t lineFreeAt;	// Момент окончания передачи последнего байта, нс
+		uint64_t lastDue;		// Порядок доставки сохраняется и при jitter
+	} Direction_t;
+
+private:
+	uint64_t nowNs() {
+		return clock.NowNs();
+	}
+
+	uint64_t deadlineNs(size_t timeoutMs) {
+		return (timeoutMs == SIZE_MAX) ? UINT64_MAX : nowNs() + timeoutMs * 1000000ull;
+	}
+
+	// xorshift32
+	uint32_t nextRandom() {
+		rnd ^= rnd << 13;
+		rnd ^= rnd >> 17;
+		rnd ^= rnd << 5;
+		return rnd;
+	}
+
+	bool chance(uint32_t ppm) {
+		return (ppm != 0) && ((nextRandom() % PPM) < ppm);
+	}
+
+	void enqueue(Direction_t &d, char c, uint64_t now) {
+		uint64_t due;
+
+		// Байт занимает линию, даже если будет потерян
+		d.lineFreeAt = ((d.lineFreeAt > now) ? d.lineFreeAt : now) + byteTimeNs;
+
+		if (chance(cfg.dropPpm)) {
+			stats.dropped++;
+			return;
+		}
+
+		if (chance(cfg.flipPpm)) {
+			c ^= (char)(1 << (nextRandom() % 8));
+			stats.flipped++;
+		}
+
+		due = d.lineFreeAt + cfg.latencyUs * 1000ull;
+		if (cfg.jitterUs)
+			due += (nextRandom() % (cfg.jitterUs + 1)) * 1000ull;
+
+		if (due < d.lastDue)
+			due = d.lastDue;
+		d.lastDue = due;
+
+		d.buff[(d.head + d.count) % QUEUE_SIZE] = {c, due};
+		d.count++;
+	}
+
+	// Передача во вложенный поток байт, время доставки которых наступило
+	int deliverTx(uint64_t now) {
+		char chunk[CHUNK_SIZE];
+		size_t n;
+		int res;
+
+		while ((tx.count > 0) && (tx.buff[tx.head].due <= now)) {
+			for (n = 0; (n < CHUNK_SIZE) && (n < tx.count); n++) {
+				const Entry_t &e = tx.buff[(tx.head + n) % QUEUE_SIZE];
+				if (e.due > now)
+					break;
+				chunk[n] = e.c;
+			}
+
+			res = inner.Write(chunk, n);
+			if (res <= 0)
+				return (res < 0) ? res : -EIO;
+
+			tx.head = (tx.head + res) % QUEUE_SIZE;
+			tx.count -= res;
+		}
+
+		return 0;
+	}
+
+	// Приём из вложенного потока, байты получают время доставки с учётом эмуляции
+	int pullRx(size_t timeoutMs) {
+		char chunk[CHUNK_SIZE];
+		size_t space = QUEUE_SIZE - rx.count;
+		uint64_t now;
+		int res;
+
+		if (space == 0)
+			return 0;
+
+		res = inner.Read(chunk, (space < CHUNK_SIZE) ? space : CHUNK_SIZE, timeoutMs);
+		if (res <= 0)
+			return res;
+
+		now = nowNs();
+		for (int i = 0; i < res; i++)
+			enqueue(rx, chunk[i], now);
+		stats.rxBytes += res;
+
+		return res;
+	}
+
+	// Ожидание момента when. Поступающие за это время данные принимаются в очередь.
+	int waitUntil(uint64_t when) {
+		uint64_t now = nowNs();
+		int res;
+
+		if (when <= now)
+			return 0;
+
+		// Ожидание приёма из вложенного потока (с точностью до миллисекунды)
+		if ((when - now >= 1000000ull) && (rx.count < QUEUE_SIZE)) {
+			res = pullRx((when - now) / 1000000ull);
+			if (res != 0)
+				return (res < 0) ? res : 0;
+		}
+
+		// Остаток менее миллисекунды или поток без собственного учёта времени
+		clock.WaitUntilNs(when);
+		return 0;
+	}
+
+
+private:
+	ParallelStream &inner;
+	Config_t cfg;
+	Clock &clock;
+	size_t writeTimeoutMs;
+
+	uint64_t byteTimeNs;
+	uint32_t rnd;
+
+	Direction_t tx;
+	Direction_t rx;
+
+	Stats_t stats;
+};
+
+
+
+#endif /* __LINK_EMULATION_STREAM_H__ */
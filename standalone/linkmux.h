@@ -0,0 +1,147 @@
+#ifndef __LINK_MUX_H__
+#define __LINK_MUX_H__
+
+#include <mutex>
+#include <thread>
+
+#include "chanmux.h"
+
+
+// Каналы последовательного порта в режиме --mux (общие для emcli и emcli_demux)
+typedef enum {
+	CH_CONSOLE = 0,		// Командная строка
+	CH_LOG,				// Журнал
+	CH_TRANSFER,		// Передача файлов (ry/sy)
+	CH_COUNT,
+} TLinkChannel;
+
+typedef ChannelMux<CH_COUNT, 1024> LinkMux;
+
+
+// Консоль - наивысший приоритет, передача файлов - наименьший
+inline void SetupLinkMux(LinkMux &mux) {
+	mux.SetPriority(CH_CONSOLE, 2);
+	mux.SetPriority(CH_LOG, 1);
+	mux.SetPriority(CH_TRANSFER, 0);
+}
+
+
+/**
+ * Канал LinkMux для работы из нескольких потоков выполнения (передача файлов
+ * в отдельном потоке). Обращения к мультиплексору выполняются под общей для
+ * всех каналов блокировкой lock. Ожидание разбито на интервалы не длиннее
+ * LinkMux::POLL_MS, между ними блокировка освобождается - ожидание одного
+ * канала не задерживает другие.
+ */
+class SharedChannel : public ParallelStream {
+public:
+	SharedChannel(LinkMux &a_mux, size_t a_n, std::mutex &a_lock, Clock &a_clock = MonotonicClock::Instance())
+	:
+	mux(a_mux),
+	n(a_n),
+	lock(a_lock),
+	clock(a_clock),
+	writeTimeoutMs(LinkMux::WRITE_TIMEOUT_MS)
+	{
+		// Ожидание кредита - здесь, с освобождением блокировки
+		std::lock_guard<std::mutex> guard(lock);
+		mux[n].SetWriteTimeout(0);
+	}
+
+	int Write(const char *p, size_t len) final {
+		uint64_t deadline = clock.NowMs() + writeTimeoutMs;
+		int res;
+
+		while (1) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				res = mux[n].Write(p, len);
+				if ((res != -EAGAIN) || (clock.NowMs() >= deadline))
+					return res;
+
+				if ((res = mux.Poll(LinkMux::POLL_MS)) < 0)
+					return res;
+			}
+
+			std::this_thread::yield();
+		}
+	}
+
+	int WriteByte(char c) final {
+		return Write(&c, 1);
+	}
+
+	int ReadByte(char *c, size_t timeoutMs) final {
+		return Read(c, 1, timeoutMs);
+	}
+
+	int Read(char *p, size_t len, size_t timeoutMs) final {
+		uint64_t deadline = clock.NowMs() + timeoutMs;
+		uint64_t now;
+		int res;
+
+		while (1) {
+			now = clock.NowMs();
+
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				res = mux[n].Read(p, len, (deadline <= now) ? 0 :
+						(deadline - now < LinkMux::POLL_MS) ? deadline - now : LinkMux::POLL_MS);
+			}
+
+			if ((res != 0) || (clock.NowMs() >= deadline))
+				return res;
+
+			std::this_thread::yield();
+		}
+	}
+
+	int Flush() final {
+		std::lock_guard<std::mutex> guard(lock);
+		return mux[n].Flush();
+	}
+
+	int Drain() final {
+		uint64_t deadline = clock.NowMs() + LinkMux::WRITE_TIMEOUT_MS;
+		int res;
+
+		while (1) {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+
+				if (mux.TxCount(n) == 0)
+					return mux[n].Drain();
+
+				if (clock.NowMs() >= deadline)
+					return -ETIMEDOUT;
+
+				if ((res = mux.Poll(LinkMux::POLL_MS)) < 0)
+					return res;
+			}
+
+			std::this_thread::yield();
+		}
+	}
+
+	// Ожидание кредита (по умолчанию LinkMux::WRITE_TIMEOUT_MS)
+	size_t SetWriteTimeout(size_t timeoutMs) final {
+		size_t prev = writeTimeoutMs;
+
+		writeTimeoutMs = timeoutMs;
+		return prev;
+	}
+
+private:
+	LinkMux &mux;
+	size_t n;
+	std::mutex &lock;
+	Clock &clock;
+
+	size_t writeTimeoutMs;
+};
+
+
+
+#endif /* __LINK_MUX_H__ */
@@ -1,28 +1,60 @@
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <cstdlib>
 #include <sys/stat.h>
+#include <atomic>
+#include <thread>
 
 extern "C" {
 #include "xmodem.h"
 }
 
 #include "spstream.h"
+#include "ptystream.h"
+#include "linkemu.h"
+#include "asyncstream.h"
+#include "linkmux.h"
+#include "sessionsrv.h"
+#include "filehistory.h"
 #include "terminal.h"
 #include "cmdproc.h"
 
 
-SerialPortStream stream("/dev/ttyUSB0", SerialPortStream::SPEED_115200);
-Terminal term(stream);
-CommandProcessor proc(term);
+const char DEFAULT_DEVICE[] = "/dev/ttyUSB0";
+const uint32_t FAST_SPEED = 3000000;		// Скорость передачи файлов с опцией --fast
+
+const size_t CAT_BLOCK_SIZE = 16384;		// Блок чтения файла, если передача без копирования невозможна
+const size_t CAT_SENDFILE_SIZE = 1 << 20;
+const size_t CAT_FRAGMENTS = 64;
+
+const size_t INPUT_SIZE = 4096;				// Строка ввода консоли (длинные команды автоматизации)
+
+Terminal *term = nullptr;
+Terminal *logTerm = nullptr;				// Журнал на канале CH_LOG (--mux), иначе stdout
+
+
+void Log(const char *fmt, ...) {
+	char line[256];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+
+	if (logTerm != nullptr)
+		logTerm->Puts(line);
+	else
+		fputs(line, stdout);
+}
 
 
 int _inbyte(unsigned short t) {
-	return term.Getc(t);
+	return term->Getc(t);
 }
 
 void _outbyte(int c) {
-	term.Putc((char)c);
+	term->Putc((char)c);
 }
 
 
@@ -37,6 +69,12 @@ cmdproc::CmdOpt_t RyCmdOpts[] = {
 				.args = "filename",
 				.description = "Rename the received file.",
 		},
+		{
+				.ch = 'f',
+				.full = "fast",
+				.args = nullptr,
+				.description = "Switch the link to a higher speed for the transfer.",
+		},
 };
 cmdproc::CmdDef_t RyCmd = {
 		.fn = CmdFn_YmodemReceive,
@@ -69,6 +107,12 @@ cmdproc::CmdOpt_t SyCmdOpts[] = {
 				.args = "filename",
 				.description = "Rename the file on the recipient side.",
 		},
+		{
+				.ch = 'f',
+				.full = "fast",
+				.args = nullptr,
+				.description = "Switch the link to a higher speed for the transfer.",
+		},
 };
 cmdproc::CmdDef_t SyCmd = {
 		.fn = CmdFn_YmodemTransmit,
@@ -103,26 +147,64 @@ void FetchChunk(void *funcCtx, void *xmodemBuffer, int xmodemSize) {
 }
 
 
-int CmdFn_YmodemReceive(void *ctx, Terminal &t, cmdproc::CmdArgs_t &a) {
+// Передача файла: path - имя файла (для ry - nullptr: имя из заголовка YMODEM),
+// name - имя файла у получателя (только sy)
+typedef int (*TTransferFn)(const char *path, const char *name);
+
+// Передача в режиме --mux - в отдельном потоке, консоль остаётся доступной
+bool transferThread = false;
+struct {
+	std::atomic<bool> busy;
+	TTransferFn fn;
+	const char *arg[2];
+	char mem[2][PATH_MAX];		// Аргументы копируются: буфер ввода консоли используется повторно
+} transfer;
+
+
+// Без --mux передача выполняется в потоке консоли (данные передачи - в консоли)
+int RunTransfer(Terminal &t, TTransferFn fn, const char *path, const char *name) {
+	const char *args[2] = {path, name};
+
+	if (!transferThread)
+		return fn(path, name);
+
+	if (transfer.busy) {
+		t.Puts("Transfer in progress\r\n");
+		return -1;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		transfer.arg[i] = (args[i] != nullptr) ? transfer.mem[i] : nullptr;
+		if (args[i] != nullptr)
+			snprintf(transfer.mem[i], sizeof(transfer.mem[i]), "%s", args[i]);
+	}
+
+	transfer.fn = fn;
+	transfer.busy = true;
+
+	std::thread([]() {
+		transfer.fn(transfer.arg[0], transfer.arg[1]);
+		transfer.busy = false;
+	}).detach();
+
+	t.Puts("Transfer started on the transfer channel\r\n");
+	return 0;
+}
+
+
+int YmodemReceive(const char *renamedFileName, const char *) {
 	int res;
 	char chunk[128];
 
-	char *renamedFileName = nullptr;
-
-	cmdproc::OptArgs_t *opt = a.opts;
-	for (int i = 0; i < a.optc; i++, opt++)
-		switch (opt->ref->ch) {
-		case 'r':
-			renamedFileName = opt->argv[0];
-			break;
-		}
+	// Данные XMODEM - без обработки ANSI-последовательностей
+	Terminal::RawMode raw(*term);
 
 	// header
 	res = XmodemReceive(nullptr, chunk, sizeof(chunk), 1, 1);
-	printf("res: %d\n", res);
+	Log("res: %d\n", res);
 
 	char *yCtrlPacket = chunk;
-	char *fileName = yCtrlPacket;
+	const char *fileName = yCtrlPacket;
 
 	if (renamedFileName != nullptr)
 		fileName = renamedFileName;
@@ -136,38 +218,64 @@ int CmdFn_YmodemReceive(void *ctx, Terminal &t, cmdproc::CmdArgs_t &a) {
 
 	char *fileSize = fileStat;
 
-	printf("Filename: %s\n", fileName);
-	printf("size: %s\n", fileSize);
+	Log("Filename: %s\n", fileName);
+	Log("size: %s\n", fileSize);
 
 	// content
 	res = XmodemReceive(StoreChunk, chunk, atoi(fileSize), 1, 0);
-	printf("res: %d\n", res);
+	Log("res: %d\n", res);
 
 	// end
 	res = XmodemReceive(nullptr, chunk, sizeof(chunk), 1, 1);
-	printf("res: %d\n", res);
+	Log("res: %d\n", res);
 
+	term->Drain();
 	close(wfd);
 
 	return 0;
 }
 
 
-int CmdFn_YmodemTransmit(void *ctx, Terminal &t, cmdproc::CmdArgs_t &a) {
+int CmdFn_YmodemReceive(void *ctx, Terminal &t, cmdproc::CmdArgs_t &a) {
+	char *renamedFileName = nullptr;
+	bool fast = false;
+	uint32_t consoleSpeed = t.GetSpeed();
 	int res;
-	char chunk[128];
-
-	char *filename = a.argv[0];
 
 	cmdproc::OptArgs_t *opt = a.opts;
 	for (int i = 0; i < a.optc; i++, opt++)
 		switch (opt->ref->ch) {
-			case 'r':	// --rename
-				filename = opt->argv[0];
-				break;
+		case 'r':
+			renamedFileName = opt->argv[0];
+			break;
+
+		case 'f':
+			fast = true;
+			break;
 		}
 
-	sfd = open(a.argv[0], O_RDONLY);
+	// С --mux скорость канала не определена (SwitchSpeed: -ENOTSUP) - поток
+	// передачи запускается только без --fast
+	if (fast && (reinterpret_cast<CommandProcessor *>(ctx)->SwitchSpeed(FAST_SPEED) < 0))
+		return -1;
+
+	res = RunTransfer(t, YmodemReceive, renamedFileName, nullptr);
+
+	if (fast)
+		t.SetSpeed(consoleSpeed);
+
+	return res;
+}
+
+
+int YmodemTransmit(const char *path, const char *filename) {
+	int res;
+	char chunk[128];
+
+	// Данные XMODEM - без обработки ANSI-последовательностей
+	Terminal::RawMode raw(*term);
+
+	sfd = open(path, O_RDONLY);
 	struct stat stat;
 
 	fstat(sfd, &stat);
@@ -175,22 +283,175 @@ int CmdFn_YmodemTransmit(void *ctx, Terminal &t, cmdproc::CmdArgs_t &a) {
 	memset(chunk, 0, sizeof(chunk));
 	sprintf(chunk, "%s", filename);
 	sprintf(&chunk[strlen(chunk)+1], "%ld", stat.st_size);
+	Log("Filename: %s\n", filename);
+	Log("size: %ld\n", stat.st_size);
+
 	// header
 	res = XmodemTransmit(nullptr, chunk, 128, 0, 1);
+	Log("res: %d\n", res);
 
 	// content
-	res = XmodemTransmit(FetchChunk, ctx, stat.st_size, 1, 0);
+	res = XmodemTransmit(FetchChunk, nullptr, stat.st_size, 1, 0);
+	Log("res: %d\n", res);
 
 	// end
 	memset(chunk, 0, sizeof(chunk));
 	res = XmodemTransmit(nullptr, chunk, 128, 0, 1);
+	Log("res: %d\n", res);
 
+	term->Drain();
 	close(sfd);
 
 	return 0;
 }
 
 
+int CmdFn_YmodemTransmit(void *ctx, Terminal &t, cmdproc::CmdArgs_t &a) {
+	char *filename = a.argv[0];
+	bool fast = false;
+	uint32_t consoleSpeed = t.GetSpeed();
+	int res;
+
+	cmdproc::OptArgs_t *opt = a.opts;
+	for (int i = 0; i < a.optc; i++, opt++)
+		switch (opt->ref->ch) {
+			case 'r':	// --rename
+				filename = opt->argv[0];
+				break;
+
+			case 'f':	// --fast
+				fast = true;
+				break;
+		}
+
+	if (fast && (reinterpret_cast<CommandProcessor *>(ctx)->SwitchSpeed(FAST_SPEED) < 0))
+		return -1;
+
+	res = RunTransfer(t, YmodemTransmit, a.argv[0], filename);
+
+	if (fast)
+		t.SetSpeed(consoleSpeed);
+
+	return res;
+}
+
+
+// Вывод блока с заменой LF на CRLF. Участки между переводами строки передаются
+// фрагментами без копирования, CRLF в файле не изменяется.
+// prev - последний символ предыдущего блока.
+int WriteCrlf(Terminal &t, const char *p, size_t len, char &prev) {
+	ParallelStream::Fragment_t frags[CAT_FRAGMENTS];
+	const char *start = p;
+	const char *end = p + len;
+	const char *nl;
+	size_t n = 0;
+	int res;
+
+	while (p < end) {
+		nl = (const char *)memchr(p, '\n', end - p);
+
+		if (nl == nullptr) {
+			frags[n++] = {p, (size_t)(end - p)};
+			p = end;
+		}
+		else if (((nl > start) ? nl[-1] : prev) == '\r') {
+			frags[n++] = {p, (size_t)(nl + 1 - p)};
+			p = nl + 1;
+		}
+		else {
+			frags[n++] = {p, (size_t)(nl - p)};
+			frags[n++] = {"\r\n", 2};
+			p = nl + 1;
+		}
+
+		if ((n + 2 > CAT_FRAGMENTS) || (p == end)) {
+			if ((res = t.WriteV(frags, n)) < 0)
+				return res;
+			n = 0;
+		}
+	}
+
+	if (len > 0)
+		prev = end[-1];
+
+	return 0;
+}
+
+
+int CmdFn_Cat(void *ctx, Terminal &t, cmdproc::CmdArgs_t &a) {
+	char block[CAT_BLOCK_SIZE];
+	char prev = '\0';
+	bool raw = false;
+	ssize_t n;
+	int res = -EINVAL;
+	int fd;
+
+	cmdproc::OptArgs_t *opt = a.opts;
+	for (int i = 0; i < a.optc; i++, opt++)
+		if (opt->ref->ch == 'r')	// --raw
+			raw = true;
+
+	fd = open(a.argv[0], O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		t.Puts(strerror(errno));
+		t.Puts("\r\n");
+		return -1;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	// Вывод в обход обработки ANSI и очереди терминала
+	Terminal::RawMode rawMode(t);
+
+	bool crlf = !raw && t.GetCrlf();
+	FdStream *fdStream = dynamic_cast<FdStream *>(&t.Stream());
+
+	// Без преобразования в дескриптор потока - без копирования. SendFile уже
+	// ожидал готовности потока его таймаут записи: -EAGAIN - ошибка.
+	if (!crlf && (fdStream != nullptr))
+		while ((res = fdStream->SendFile(fd, CAT_SENDFILE_SIZE)) > 0);
+
+	// SendFile не вызывался (требуется преобразование или поток не FdStream)
+	// или вернул -EINVAL (sendfile/splice из файла невозможны) - чтение блоками
+	if (res == -EINVAL)
+		while ((n = read(fd, block, sizeof(block))) != 0) {
+			if (n < 0) {
+				res = -errno;
+				break;
+			}
+
+			if ((res = crlf ? WriteCrlf(t, block, n, prev) : t.Write(block, n)) < 0)
+				break;
+		}
+
+	if (res < 0) {
+		t.Puts(strerror(-res));
+		t.Puts("\r\n");
+	}
+
+	close(fd);
+	return (res < 0) ? -1 : 0;
+}
+
+cmdproc::CmdOpt_t CatCmdOpts[] = {
+		{
+				.ch = 'r',
+				.full = "raw",
+				.args = nullptr,
+				.description = "Output the file as is, without LF -> CRLF translation.",
+		},
+};
+cmdproc::CmdDef_t CatCmd = {
+		.fn = CmdFn_Cat,
+		.ctx = nullptr,
+		.cmd = "cat",
+		.args = "filepath",
+		.options = CatCmdOpts,
+		.optc = sizeof(CatCmdOpts) / sizeof(cmdproc::CmdOpt_t),
+		.descr = "Output the contents of a text file."
+};
+
+
 int TestFunction(void *ctx, Terminal &t, cmdproc::CmdArgs_t &a) {
 	t.Puts("Args:\r\n");
 	for (int i = 0; i < a.argc; i++) {
@@ -270,61 +531,321 @@ const char *autocompTable[] = {
 		"test",
 		"sy",
 		"ry",
+		"cat",
 };
 
 
-int main() {
+typedef struct {
+	const char *kind;
+	const char *device;
+	const char *link;
+	uint32_t baud;
+	uint32_t serialOpts;
+	Terminal::TTxPolicy txPolicy;
+	bool asyncTx;
+	bool mux;
+	bool crlf;
+	const char *history;
+
+	uint16_t tcpPort;
+	bool tcpAny;
+	const char *unixPath;
+	size_t threads;
+} Args_t;
+
+
+void PrintUsage(const char *name) {
+	printf("Usage:\n"
+		   "\t%s [serial [device] [--baud <baud>] [--low-latency] [--flow <rtscts|xonxoff>] [--rx-thread] | pty]\n"
+		   "\t\t[--link <baud>[,<latency.us>[,<jitter.us>[,<drop.ppm>[,<flip.ppm>[,<seed>]]]]]]\n"
+		   "\t\t[--tx-policy <block|drop|fail>] [--async-tx] [--mux] [--lf]\n"
+		   "\t\t[--history <file>]\n"
+		   "\t%s serve [--tcp <port> [--public]] [--unix <path>] [--threads <n>]\n"
+		   "\n"
+		   "\tserial [device]\tConsole on a serial port (default: %s)\n"
+		   "\t--baud\t\tAny integer serial speed (default: 115200)\n"
+		   "\t--low-latency\tRequest low-latency serial handling from the driver\n"
+		   "\t--flow\t\tHardware (RTS/CTS) or software (XON/XOFF, text only) flow control\n"
+		   "\t--rx-thread\tDrain the port continuously from a dedicated receive thread\n"
+		   "\tpty\t\tConsole on a pseudo-terminal, the slave path is printed on start\n"
+		   "\t--link\t\tEmulate a link with limited speed, latency and bit errors\n"
+		   "\t--tx-policy\tWhat to do when the output queue is full (default: block)\n"
+		   "\t--async-tx\tTransmit from a writer thread, double-buffering the console output (not with --link)\n"
+		   "\t--mux\t\tConsole, log and file transfers on separate channels (see emcli_demux)\n"
+		   "\t--lf\t\tThe terminal translates LF to CRLF itself, cat sends files unchanged\n"
+		   "\t--history\tKeep the console history in a file shared by all running instances\n"
+		   "\tserve\t\tCommand line for many clients over TCP and/or a Unix socket\n"
+		   "\t--public\tAccept TCP clients from other hosts (default: loopback only, no authentication)\n"
+		   "\t--threads\tEvent loop threads for serve (default: 1)\n",
+		   name, name, DEFAULT_DEVICE);
+}
+
+bool ParseArgs(int argc, char *argv[], Args_t &args) {
+	args = {
+			.kind = "serial",
+			.device = DEFAULT_DEVICE,
+			.link = nullptr,
+			.baud = 115200,
+			.serialOpts = SerialPortStream::OPT_POLL_TIMEOUT | SerialPortStream::OPT_THROUGHPUT,
+			.txPolicy = Terminal::TX_BLOCK,
+			.asyncTx = false,
+			.mux = false,
+			.crlf = true,
+			.history = nullptr,
+			.tcpPort = 0,
+			.tcpAny = false,
+			.unixPath = nullptr,
+			.threads = 1,
+	};
+
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *val = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+		if ((strcmp(arg, "--link") == 0) && val) {
+			args.link = val;
+			i++;
+		}
+		else if ((strcmp(arg, "--baud") == 0) && val) {
+			args.baud = strtoul(val, nullptr, 10);
+			i++;
+		}
+		else if (strcmp(arg, "--low-latency") == 0)
+			args.serialOpts |= SerialPortStream::OPT_LOW_LATENCY;
+		else if (strcmp(arg, "--rx-thread") == 0)
+			args.serialOpts |= SerialPortStream::OPT_RX_THREAD;
+		else if ((strcmp(arg, "--flow") == 0) && val && (strcmp(val, "rtscts") == 0)) {
+			args.serialOpts |= SerialPortStream::OPT_RTSCTS;
+			i++;
+		}
+		else if ((strcmp(arg, "--flow") == 0) && val && (strcmp(val, "xonxoff") == 0)) {
+			args.serialOpts |= SerialPortStream::OPT_XONXOFF;
+			i++;
+		}
+		else if ((strcmp(arg, "--tx-policy") == 0) && val && (strcmp(val, "block") == 0)) {
+			args.txPolicy = Terminal::TX_BLOCK;
+			i++;
+		}
+		else if ((strcmp(arg, "--tx-policy") == 0) && val && (strcmp(val, "drop") == 0)) {
+			args.txPolicy = Terminal::TX_DROP_OLDEST;
+			i++;
+		}
+		else if ((strcmp(arg, "--tx-policy") == 0) && val && (strcmp(val, "fail") == 0)) {
+			args.txPolicy = Terminal::TX_FAIL_FAST;
+			i++;
+		}
+		else if (strcmp(arg, "--async-tx") == 0)
+			args.asyncTx = true;
+		else if (strcmp(arg, "--mux") == 0)
+			args.mux = true;
+		else if (strcmp(arg, "--lf") == 0)
+			args.crlf = false;
+		else if ((strcmp(arg, "--history") == 0) && val) {
+			args.history = val;
+			i++;
+		}
+		else if ((strcmp(arg, "--tcp") == 0) && val) {
+			args.tcpPort = strtoul(val, nullptr, 10);
+			i++;
+		}
+		else if (strcmp(arg, "--public") == 0)
+			args.tcpAny = true;
+		else if ((strcmp(arg, "--unix") == 0) && val) {
+			args.unixPath = val;
+			i++;
+		}
+		else if ((strcmp(arg, "--threads") == 0) && val) {
+			args.threads = strtoul(val, nullptr, 10);
+			i++;
+		}
+		else if ((i == 1) && (arg[0] != '-'))
+			args.kind = arg;
+		else if ((i == 2) && (strcmp(args.kind, "serial") == 0))
+			args.device = arg;
+		else
+			return false;
+	}
+
+	// Эмуляция линии не передаёт асинхронную запись - она выполнялась бы синхронно
+	if (args.asyncTx && (args.link != nullptr))
+		return false;
+
+	return true;
+}
+
+ParallelStream * OpenStream(const Args_t &args) {
+	LinkEmuStream::Config_t cfg = {0, 0, 0, 0, 0, 1};
+	ParallelStream *stream = nullptr;
+
+	// Параметры эмуляции линии - до открытия порта
+	if ((args.link != nullptr) &&
+		(sscanf(args.link, "%u,%u,%u,%u,%u,%u", &cfg.baud, &cfg.latencyUs, &cfg.jitterUs,
+				&cfg.dropPpm, &cfg.flipPpm, &cfg.seed) < 1))
+		return nullptr;
+
+	if (strcmp(args.kind, "serial") == 0) {
+		auto *serial = new SerialPortStream(args.device, args.baud, args.serialOpts);
+		if (!serial->IsOpen()) {
+			delete serial;
+			return nullptr;
+		}
+
+		stream = serial;
+	}
+	else if (strcmp(args.kind, "pty") == 0) {
+		auto *pty = new PtyStream();
+		if (!pty->IsOpen()) {
+			delete pty;
+			return nullptr;
+		}
+
+		printf("PTY: %s\n", pty->SlavePath());
+		fflush(stdout);
+		stream = pty;
+	}
+	else
+		return nullptr;
+
+	if (args.asyncTx)
+		stream = new AsyncWriteStream(*stream);
+
+	if (args.link != nullptr)
+		stream = new LinkEmuStream(*stream, cfg);
+
+	return stream;
+}
+
+
+const char * InputPrefix() {
 	static char prefix[64];
-	ANSI::Encode(prefix, ANSI::STYLE, ANSI::STYLE_BOLD, ANSI::STYLE_FG_GREEN, ANSI::STYLE_END);
-	sprintf(&prefix[strlen(prefix)], "ktrc");
-	ANSI::Encode(&prefix[strlen(prefix)], ANSI::STYLE, ANSI::STYLE_RESET, ANSI::STYLE_END);
-	sprintf(&prefix[strlen(prefix)], "# ");
 
-	proc.SetInputPrefix(prefix);
+	if (prefix[0] == '\0') {
+		ANSI::Encode(prefix, ANSI::STYLE, ANSI::STYLE_BOLD, ANSI::STYLE_FG_GREEN, ANSI::STYLE_END);
+		sprintf(&prefix[strlen(prefix)], "ktrc");
+		ANSI::Encode(&prefix[strlen(prefix)], ANSI::STYLE, ANSI::STYLE_RESET, ANSI::STYLE_END);
+		sprintf(&prefix[strlen(prefix)], "# ");
+	}
+
+	return prefix;
+}
+
+
+// Сеанс сервера: команды, не требующие последовательного порта.
+// Без cat: вывод файла не ограничен по времени и открывает любые файлы процесса.
+void SetupSession(void *, CommandProcessor &proc) {
+	proc.SetInputPrefix(InputPrefix());
+	proc.Register(TestCmd);
+}
+
+SessionServer *server = nullptr;
+
+void StopServer(int) {
+	server->Stop();
+}
+
+int RunServer(const Args_t &args) {
+	SessionServer srv(SetupSession, nullptr);
+	int res;
+
+	if ((args.tcpPort == 0) && (args.unixPath == nullptr))
+		return -EINVAL;
+
+	if ((args.tcpPort != 0) && ((res = srv.ListenTcp(args.tcpPort, args.tcpAny)) < 0)) {
+		printf("TCP port %u: %s\n", args.tcpPort, strerror(-res));
+		return res;
+	}
+
+	if ((args.unixPath != nullptr) && ((res = srv.ListenUnix(args.unixPath)) < 0)) {
+		printf("%s: %s\n", args.unixPath, strerror(-res));
+		return res;
+	}
+
+	// Приглашение строится до запуска потоков обработки
+	InputPrefix();
+
+	server = &srv;
+	signal(SIGINT, StopServer);
+	signal(SIGTERM, StopServer);
+
+	res = srv.Run(args.threads);
+
+	// srv уничтожается при выходе
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	server = nullptr;
+
+	return res;
+}
+
+
+int main(int argc, char *argv[]) {
+	Args_t args;
+
+	if (!ParseArgs(argc, argv, args)) {
+		PrintUsage(argv[0]);
+		return 1;
+	}
+
+	if (strcmp(args.kind, "serve") == 0) {
+		int res = RunServer(args);
+
+		if (res == -EINVAL)
+			PrintUsage(argv[0]);
+		return (res < 0) ? 1 : 0;
+	}
+
+	ParallelStream *stream = OpenStream(args);
+	if (stream == nullptr)
+		return 1;
+
+	// Консоль на канале 0, журнал и передача файлов - на отдельных каналах.
+	// Передача выполняется в отдельном потоке: на время ry/sy консоль отвечает,
+	// мультиплексор - под общей блокировкой каналов.
+	static std::mutex muxLock;
+	LinkMux *mux = args.mux ? new LinkMux(*stream) : nullptr;
+	if (mux != nullptr) {
+		SetupLinkMux(*mux);
+
+		// Журнал не задерживает работу, если его не читают
+		logTerm = new Terminal(*new SharedChannel(*mux, CH_LOG, muxLock));
+		logTerm->SetTxPolicy(Terminal::TX_DROP_OLDEST);
+	}
+
+	static char inputMem[2 * INPUT_SIZE];
+
+	Terminal t(mux ? *new SharedChannel(*mux, CH_CONSOLE, muxLock) : *stream);
+	CommandProcessor proc(t, inputMem, INPUT_SIZE);
+	term = mux ? new Terminal(*new SharedChannel(*mux, CH_TRANSFER, muxLock)) : &t;
+	transferThread = (mux != nullptr);
+
+	t.SetTxPolicy(args.txPolicy);
+	t.SetCrlf(args.crlf);
+	// Вставленный скрипт - блоками, строки выполняются по очереди
+	t.SetBracketedPaste(true);
+
+	if (args.history != nullptr) {
+		FileHistory *history = new FileHistory(args.history);
+		if (history->IsOpen())
+			t.SetHistoryStore(history);
+	}
+
+	proc.SetInputPrefix(InputPrefix());
+
+	RyCmd.ctx = &proc;
+	SyCmd.ctx = &proc;
 
 	proc.Register(RyCmd);
 	proc.Register(SyCmd);
+	proc.Register(CatCmd);
 	proc.Register(TestCmd);
 
-	/*
-	term.historyWriteNewest("hello world 1");
-	term.historySaveNewest();
-	term.historyWriteNewest("hello world 2");
-	term.historySaveNewest();
-	term.historyWriteNewest("hello world 3");
-	term.historySaveNewest();
-	term.historyWriteNewest("hello world 4");
-	term.historySaveNewest();
-	term.historyWriteNewest("a?");
-	term.historySaveNewest();
-
-	printf("f. %s\n", term.historyForward());
-
-	printf("b. %s\n", term.historyBack());
-	printf("b. %s\n", term.historyBack());
-	printf("b. %s\n", term.historyBack());
-	printf("b. %s\n", term.historyBack());
-	printf("b. %s\n", term.historyBack());
-	printf("b. %s\n", term.historyBack());
-
-	printf("f. %s\n", term.historyForward());
-	printf("f. %s\n", term.historyForward());
-	printf("f. %s\n", term.historyForward());
-	printf("f. %s\n", term.historyForward());
-	printf("f. %s\n", term.historyForward());
-	printf("f. %s\n", term.historyForward());
-
-	printf("b. %s\n", term.historyBack());
-	printf("f. %s\n", term.historyForward());
-	*/
-
-	//term.SetAutocomplete(autocompTable, sizeof(autocompTable) / sizeof(size_t));
+	//t.SetAutocomplete(autocompTable, sizeof(autocompTable) / sizeof(size_t));
 
 
 	//proc.Exec("test -1 -2 arg1 --opt3 -4 arg2 arg3 \"argument 1\" \"argument 2\"");
 	//proc.Exec("test arg4 -1");
 
-	//CmdFn_YmodemReceive(nullptr, term, 0, nullptr);
+	//CmdFn_YmodemReceive(nullptr, t, 0, nullptr);
 
 	proc.Run();
 
@@ -0,0 +1,80 @@
+#ifndef __PTY_STREAM_H__
+#define __PTY_STREAM_H__
+
+#include <stdlib.h>
+#include <termios.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fdstream.h"
+
+
+/**
+ * Поток поверх псевдотерминала.
+ *
+ * Терминал работает со стороной master, к стороне slave (SlavePath)
+ * подключается клиент: screen, picocom, sz/rz или тестовый скрипт.
+ * Позволяет измерять производительность без аппаратного адаптера.
+ */
+class PtyStream : public FdStream {
+public:
+	static const size_t MAX_PATH_LEN = 64;
+
+public:
+	PtyStream()
+	:
+	slaveFd(-1)
+	{
+		struct termios tty;
+
+		slavePath[0] = '\0';
+
+		fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (fd < 0) {
+			printf("Error %i from posix_openpt: %s\n", errno, strerror(errno));
+			return;
+		}
+
+		if ((grantpt(fd) != 0) || (unlockpt(fd) != 0) ||
+			(ptsname_r(fd, slavePath, sizeof(slavePath)) != 0)) {
+			printf("Error %i from grantpt/unlockpt: %s\n", errno, strerror(errno));
+			close(fd);
+			fd = -1;
+			return;
+		}
+
+		// Собственный дескриптор slave: без него master получает EIO/POLLHUP,
+		// пока клиент не подключён или между его подключениями
+		slaveFd = open(slavePath, O_RDWR | O_NOCTTY);
+		if (slaveFd < 0) {
+			printf("Error %i from open: %s\n", errno, strerror(errno));
+			return;
+		}
+
+		// Прозрачная передача двоичных данных (YMODEM)
+		if (tcgetattr(slaveFd, &tty) == 0) {
+			cfmakeraw(&tty);
+			tcsetattr(slaveFd, TCSANOW, &tty);
+		}
+	}
+
+	~PtyStream() {
+		if (slaveFd >= 0)
+			close(slaveFd);
+	}
+
+	const char * SlavePath() const {
+		return slavePath;
+	}
+
+private:
+	int slaveFd;
+	char slavePath[MAX_PATH_LEN];
+};
+
+
+
+#endif /* __PTY_STREAM_H__ */
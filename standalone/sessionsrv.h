@@ -0,0 +1,360 @@
+#ifndef __SESSION_SERVER_H__
+#define __SESSION_SERVER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "sockstream.h"
+#include "terminal.h"
+#include "cmdproc.h"
+
+
+/**
+ * Сервер командной строки для множества одновременных сеансов по TCP и Unix-сокетам.
+ *
+ * Каждый сеанс - собственные SocketStream, Terminal (состояние редактирования,
+ * история) и CommandProcessor. Принятые данные передаются в Terminal::Feed
+ * в цикле epoll, без отдельного потока выполнения на сеанс; при нескольких
+ * потоках каждый ведёт свой epoll, новое соединение принимает один
+ * из них (EPOLLEXCLUSIVE).
+ *
+ * Команда выполняется в потоке цикла событий: долгая команда задерживает
+ * остальные сеансы этого потока.
+ */
+class SessionServer {
+public:
+	static const int MAX_EVENTS = 64;
+	static const int LISTEN_BACKLOG = 128;
+	static const size_t MAX_LISTENERS = 4;
+	static const size_t RX_CHUNK = 512;
+	static const size_t RX_BURST = 4;
+
+	// Настройка нового сеанса: регистрация команд, приглашение ввода
+	typedef void (*TSetup)(void *ctx, CommandProcessor &proc);
+
+public:
+	SessionServer(TSetup a_setup, void *a_ctx)
+	:
+	setup(a_setup),
+	ctx(a_ctx),
+	nListeners(0),
+	sessions(0)
+	{
+		stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (stopFd < 0)
+			printf("Error %i from eventfd: %s\n", errno, strerror(errno));
+
+		unixPath[0] = '\0';
+	}
+
+	~SessionServer() {
+		for (size_t i = 0; i < nListeners; i++)
+			close(listeners[i]);
+
+		if (unixPath[0] != '\0')
+			unlink(unixPath);
+
+		if (stopFd >= 0)
+			close(stopFd);
+	}
+
+	/**
+	 * Приём подключений по IPv4 и IPv6 (если поддерживается системой).
+	 * Сеансы не требуют аутентификации: без anyAddr подключения принимаются
+	 * только с локального узла.
+	 *
+	 * @return 0 или отрицательный код ошибки
+	 */
+	int ListenTcp(uint16_t port, bool anyAddr = false) {
+		struct sockaddr_in addr4 = {};
+		struct sockaddr_in6 addr6 = {};
+		int res;
+
+		addr4.sin_family = AF_INET;
+		addr4.sin_port = htons(port);
+		addr4.sin_addr.s_addr = htonl(anyAddr ? INADDR_ANY : INADDR_LOOPBACK);
+
+		addr6.sin6_family = AF_INET6;
+		addr6.sin6_port = htons(port);
+		addr6.sin6_addr = anyAddr ? in6addr_any : in6addr_loopback;
+
+		if ((res = listenTcp(AF_INET, (struct sockaddr *)&addr4, sizeof(addr4))) < 0)
+			return res;
+
+		// IPv6 отключён - достаточно IPv4
+		res = listenTcp(AF_INET6, (struct sockaddr *)&addr6, sizeof(addr6));
+		return ((res == -EAFNOSUPPORT) || (res == -EADDRNOTAVAIL)) ? 0 : res;
+	}
+
+	int ListenUnix(const char *path) {
+		struct sockaddr_un addr = {};
+		int fd;
+
+		if (nListeners == MAX_LISTENERS)
+			return -ENOSPC;
+
+		if (strlen(path) >= sizeof(addr.sun_path))
+			return -ENAMETOOLONG;
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -errno;
+
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path);
+		unlink(path);
+
+		int res = addListener(fd, (struct sockaddr *)&addr, sizeof(addr));
+		if (res == 0)
+			strcpy(unixPath, path);
+
+		return res;
+	}
+
+	/**
+	 * Обработка сеансов в threads потоках (включая вызывающий) до вызова Stop.
+	 * Сеансы закрываются при выходе.
+	 *
+	 * @return 0 или отрицательный код ошибки
+	 */
+	int Run(size_t threads = 1) {
+		std::vector<std::thread> workers;
+		int res;
+
+		if ((stopFd < 0) || (nListeners == 0))
+			return -EINVAL;
+
+		// Запись в закрытое соединение - ошибка записи, а не завершение процесса
+		signal(SIGPIPE, SIG_IGN);
+
+		for (size_t i = 1; i < threads; i++)
+			workers.emplace_back([this]() { shardLoop(); });
+
+		res = shardLoop();
+
+		for (auto &w : workers)
+			w.join();
+
+		return res;
+	}
+
+	// Завершение Run. Допускается вызов из обработчика сигнала.
+	void Stop() {
+		uint64_t one = 1;
+		write(stopFd, &one, sizeof(one));
+	}
+
+	size_t Sessions() const {
+		return sessions.load(std::memory_order_relaxed);
+	}
+
+private:
+	struct Session {
+		SocketStream stream;
+		Terminal term;
+		CommandProcessor proc;
+
+		Session *prev;			// Сеансы потока обработки
+		Session *next;
+
+		Session(int fd)
+		:
+		stream(fd),
+		term(stream),
+		proc(term),
+		prev(nullptr),
+		next(nullptr)
+		{}
+	};
+
+private:
+	int listenTcp(int family, struct sockaddr *addr, socklen_t len) {
+		int one = 1;
+		int fd;
+
+		if (nListeners == MAX_LISTENERS)
+			return -ENOSPC;
+
+		fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -errno;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		// IPv4 принимается отдельным сокетом
+		if (family == AF_INET6)
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+
+		return addListener(fd, addr, len);
+	}
+
+	int addListener(int fd, struct sockaddr *addr, socklen_t len) {
+		if ((bind(fd, addr, len) < 0) || (listen(fd, LISTEN_BACKLOG) < 0)) {
+			int res = -errno;
+			close(fd);
+			return res;
+		}
+
+		listeners[nListeners++] = fd;
+		return 0;
+	}
+
+	bool isListener(void *ptr) const {
+		return (ptr >= (const void *)&listeners[0]) && (ptr < (const void *)&listeners[nListeners]);
+	}
+
+	int shardLoop() {
+		struct epoll_event events[MAX_EVENTS];
+		struct epoll_event ev;
+		Session *list = nullptr;
+		int ep;
+		int n;
+		int res = 0;
+
+		ep = epoll_create1(EPOLL_CLOEXEC);
+		if (ep < 0)
+			return -errno;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &stopFd;
+		epoll_ctl(ep, EPOLL_CTL_ADD, stopFd, &ev);
+
+		for (size_t i = 0; i < nListeners; i++) {
+			ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+			ev.data.ptr = &listeners[i];
+			epoll_ctl(ep, EPOLL_CTL_ADD, listeners[i], &ev);
+		}
+
+		while (1) {
+			n = epoll_wait(ep, events, MAX_EVENTS, -1);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				res = -errno;
+				break;
+			}
+
+			for (int i = 0; i < n; i++) {
+				void *ptr = events[i].data.ptr;
+
+				if (ptr == &stopFd)
+					goto exit;
+
+				if (isListener(ptr)) {
+					acceptAll(ep, *(int *)ptr, list);
+					continue;
+				}
+
+				Session *s = (Session *)ptr;
+
+				// Разрыв соединения обнаруживается чтением (-ECONNRESET)
+				if (serviceSession(s) < 0)
+					closeSession(ep, s, list);
+			}
+		}
+
+	exit:
+		while (list != nullptr)
+			closeSession(ep, list, list);
+
+		close(ep);
+		return res;
+	}
+
+	void acceptAll(int ep, int lfd, Session *&list) {
+		struct epoll_event ev;
+		Session *s;
+		int fd;
+		int one = 1;
+
+		while ((fd = accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+			s = new Session(fd);
+
+			// Медленный клиент теряет вывод, а не останавливает остальные сеансы
+			s->stream.SetWriteTimeout(0);
+			s->term.SetTxPolicy(Terminal::TX_DROP_OLDEST);
+
+			if (setup != nullptr)
+				setup(ctx, s->proc);
+
+			ev.events = EPOLLIN | EPOLLRDHUP;
+			ev.data.ptr = s;
+			if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+				delete s;
+				continue;
+			}
+
+			s->next = list;
+			if (list != nullptr)
+				list->prev = s;
+			list = s;
+			sessions.fetch_add(1, std::memory_order_relaxed);
+
+			s->proc.Listen();
+		}
+	}
+
+	// Передача принятых данных сеанса терминалу: не более RX_BURST блоков
+	// за событие - непрерывный ввод одного клиента не задерживает остальные
+	// сеансы потока (остаток сообщается следующим событием epoll)
+	static int serviceSession(Session *s) {
+		char buff[RX_CHUNK];
+		int res;
+
+		for (size_t i = 0; i < RX_BURST; i++) {
+			if ((res = s->stream.Read(buff, sizeof(buff), 0)) <= 0)
+				return res;
+
+			if ((res = s->term.Feed(buff, res)) < 0)
+				return res;
+		}
+
+		return 0;
+	}
+
+	void closeSession(int ep, Session *s, Session *&list) {
+		epoll_ctl(ep, EPOLL_CTL_DEL, s->stream.Fd(), nullptr);
+
+		if (s->prev != nullptr)
+			s->prev->next = s->next;
+		else
+			list = s->next;
+		if (s->next != nullptr)
+			s->next->prev = s->prev;
+
+		sessions.fetch_sub(1, std::memory_order_relaxed);
+		delete s;
+	}
+
+
+private:
+	TSetup setup;
+	void *ctx;
+
+	int listeners[MAX_LISTENERS];
+	size_t nListeners;
+	char unixPath[sizeof(((struct sockaddr_un *)nullptr)->sun_path)];
+
+	int stopFd;
+	std::atomic<size_t> sessions;
+};
+
+
+
+#endif /* __SESSION_SERVER_H__ */
@@ -0,0 +1,62 @@
+#ifndef __SOCKET_STREAM_H__
+#define __SOCKET_STREAM_H__
+
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+
+#include "fdstream.h"
+
+
+/**
+ * Поток поверх подключённого сокета (TCP, Unix).
+ *
+ * Закрытие соединения клиентом возвращается из Read как -ECONNRESET,
+ * а не как таймаут.
+ */
+class SocketStream : public FdStream {
+public:
+	// Принимает владение дескриптором, переводит его в неблокирующий режим
+	SocketStream(int a_fd) {
+		fd = a_fd;
+
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+			printf("Error %i from fcntl: %s\n", errno, strerror(errno));
+	}
+
+	int Read(char *p, size_t len, size_t timeoutMs) final {
+		struct pollfd pfd = {.fd = fd, .events = POLLIN, .revents = 0};
+		ssize_t res;
+
+		while (1) {
+			res = read(fd, p, len);
+			if (res > 0)
+				return res;
+			else if ((res == 0) && (len > 0))
+				return -ECONNRESET;
+			else if ((res < 0) && (errno == EINTR))
+				continue;
+			else if ((res < 0) && (errno != EAGAIN))
+				return -errno;
+
+			if (timeoutMs == 0)
+				return 0;
+
+			res = poll(&pfd, 1, (timeoutMs > INT_MAX) ? INT_MAX : (int)timeoutMs);
+			if (res == 0)
+				return 0;
+			else if (res < 0)
+				return (errno == EINTR) ? 0 : -errno;
+
+			// Готовность к чтению - повтор read() (данные или закрытие)
+			timeoutMs = 0;
+		}
+	}
+};
+
+
+
+#endif /* __SOCKET_STREAM_H__ */
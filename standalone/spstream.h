@@ -2,17 +2,48 @@
 #define __SERIAL_PORT_STREAM_H__
 
 #include <stddef.h>
+#include <stdint.h>
 #include <termios.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+#include <thread>
 
-#include "paralstream.h"
+#if defined(__linux__)
+#include <linux/serial.h>
 
+// Произвольная скорость через TCGETS2/TCSETS2 + BOTHER.
+// <asm/termbits.h> несовместим с <termios.h>, поэтому структура
+// объявляется здесь (раскладка x86, ARM, RISC-V).
+#ifndef BOTHER
+#define BOTHER 0010000
+#define IBSHIFT 16
 
-class SerialPortStream : public ParallelStream {
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+#endif
+#endif
+
+#include "fdstream.h"
+#include "spscring.h"
+
+
+class SerialPortStream : public FdStream {
 public:
 	typedef enum {
 		SPEED_57600 = B57600,
@@ -32,9 +63,53 @@ public:
 		SPEED_4000000 = B4000000,
 	} TSpeed;
 
+	typedef enum : uint32_t {
+		OPT_NONE = 0,
+		OPT_POLL_TIMEOUT = (1 << 0),	// Таймауты чтения через poll() вместо перенастройки VTIME
+		OPT_THROUGHPUT = (1 << 1),		// Без O_SYNC, накопление записи в буфере потока
+		OPT_LOW_LATENCY = (1 << 2),		// ASYNC_LOW_LATENCY (для FTDI - таймер задержки 1 мс)
+		OPT_RTSCTS = (1 << 3),			// Аппаратное управление потоком RTS/CTS
+		OPT_XONXOFF = (1 << 4),			// Программное управление потоком XON/XOFF
+										// (несовместимо с двоичной передачей YMODEM)
+		OPT_RX_THREAD = (1 << 5),		// Отдельный поток приёма, непрерывно вычитывающий порт
+										// (включает OPT_POLL_TIMEOUT)
+	} TOption;
+
+	static const size_t TX_BUFF_SIZE = 4096;
+	static const size_t RX_RING_SIZE = 16384;
+	static const int RX_PUMP_POLL_MS = 100;
+
+	typedef struct {
+		uint64_t received;		// Принято потоком приёма
+		uint64_t overruns;		// Потеряно из-за заполнения кольцевого буфера
+	} RxStats_t;
+
 private:
-	int fd;
 	int prevTimeout;
+	uint32_t options;
+
+	struct {
+		char buff[TX_BUFF_SIZE];
+		size_t len;
+	} tx;
+
+	struct {
+		std::thread thread;
+		std::atomic<bool> stop;
+
+		SpscRing<RX_RING_SIZE> ring;
+
+		// Пробуждение читателя: seq увеличивается при каждой записи в ring,
+		// futex будится только при наличии ожидающих
+		std::atomic<uint32_t> seq;
+		std::atomic<uint32_t> waiters;
+
+		// Ошибка порта (отключение устройства): поток приёма завершён
+		std::atomic<int> err;
+
+		std::atomic<uint64_t> received;
+		std::atomic<uint64_t> overruns;
+	} rx;
 
 	int initInterface(TSpeed speed) {
 		struct termios tty;
@@ -58,6 +133,8 @@ private:
 		tty.c_cc[VTIME] = 5;            // 0.5 seconds read timeout
 
 		tty.c_iflag &= ~(IXON | IXOFF | IXANY | INLCR | IGNCR | ICRNL); // shut off xon/xoff ctrl
+		if (options & OPT_XONXOFF)
+			tty.c_iflag |= IXON | IXOFF;
 
 		tty.c_cflag |= (CLOCAL | CREAD);// ignore modem controls,
 		// enable reading
@@ -65,6 +142,8 @@ private:
 		tty.c_cflag |= 0; // 8n1
 		tty.c_cflag &= ~CSTOPB;
 		tty.c_cflag &= ~CRTSCTS;
+		if (options & OPT_RTSCTS)
+			tty.c_cflag |= CRTSCTS;
 
 		if (tcsetattr (fd, TCSANOW, &tty) != 0)
 		{
@@ -90,41 +169,324 @@ private:
 			printf("error %d setting term attributes", errno);
 	}
 
-public:
-	SerialPortStream(const char *device, TSpeed speed) {
-		fd = open(device, O_RDWR | O_NOCTTY | O_SYNC);
+	int openPort(const char *device, TSpeed speed) {
+		tx.len = 0;
+
+		rx.stop = false;
+		rx.err = 0;
+		rx.seq = 0;
+		rx.waiters = 0;
+		rx.received = 0;
+		rx.overruns = 0;
+
+		if (options & OPT_RX_THREAD)
+			options |= OPT_POLL_TIMEOUT;
+
+		if (options & OPT_THROUGHPUT)
+			fd = open(device, O_RDWR | O_NOCTTY);
+		else
+			fd = open(device, O_RDWR | O_NOCTTY | O_SYNC);
 
 		if (fd < 0) {
 			printf("Error %i from open: %s\n", errno, strerror(errno));
+			return -1;
+		}
+
+		initInterface(speed);
+
+		if (options & OPT_POLL_TIMEOUT) {
+			// VMIN = 0, VTIME = 0: read() не блокируется, ожидание выполняет poll().
+			// O_NONBLOCK: запись при остановленном управлением потоком передатчике
+			// ограничена таймаутом записи (SetWriteTimeout)
+			prevTimeout = 0;
+			setBlocking(false, 0);
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		} else {
+			prevTimeout = 500;
+			setBlocking(false, prevTimeout / 100);
+		}
+
+		if (options & OPT_LOW_LATENCY)
+			setLowLatency();
+
+		if (options & OPT_RX_THREAD)
+			rx.thread = std::thread(&SerialPortStream::rxPump, this);
+
+		return 0;
+	}
+
+	// Поток приёма: непрерывное чтение порта в кольцевой буфер
+	void rxPump() {
+		char chunk[1024];
+		size_t pushed;
+		int res;
+
+		while (!rx.stop.load(std::memory_order_relaxed)) {
+			res = pollRead(chunk, sizeof(chunk), RX_PUMP_POLL_MS);
+			if ((res == 0) || (res == -EINTR))
+				continue;
+
+			// Ошибка сохраняется для читателей, ожидающие пробуждаются
+			if (res < 0) {
+				rx.err.store(res);
+				rx.seq.fetch_add(1);
+				syscall(SYS_futex, &rx.seq, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+				return;
+			}
+
+			pushed = rx.ring.Push(chunk, res);
+
+			rx.received.fetch_add(res, std::memory_order_relaxed);
+			if (pushed < (size_t)res)
+				rx.overruns.fetch_add(res - pushed, std::memory_order_relaxed);
+
+			rx.seq.fetch_add(1);
+			if (rx.waiters.load() > 0)
+				syscall(SYS_futex, &rx.seq, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+		}
+	}
+
+	// Чтение из кольцевого буфера потока приёма с ожиданием не дольше timeoutMs.
+	// Ошибка потока приёма возвращается после опустошения буфера.
+	int ringRead(char *p, size_t len, size_t timeoutMs) {
+		struct timespec now, deadline, wait;
+		uint32_t seq;
+		size_t n;
+		int res;
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeoutMs / 1000;
+		deadline.tv_nsec += (timeoutMs % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (1) {
+			if ((n = rx.ring.Pop(p, len)) > 0)
+				return n;
+
+			if ((res = rx.err.load()) < 0)
+				return res;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			wait.tv_sec = deadline.tv_sec - now.tv_sec;
+			wait.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (wait.tv_nsec < 0) {
+				wait.tv_sec--;
+				wait.tv_nsec += 1000000000;
+			}
+			if (wait.tv_sec < 0)
+				return 0;
+
+			// Регистрация ожидания до повторной проверки буфера - запись,
+			// выполненная между проверкой и futex, не будет пропущена
+			rx.waiters.fetch_add(1);
+			seq = rx.seq.load();
+
+			if (rx.ring.Empty() && (rx.err.load() == 0))
+				syscall(SYS_futex, &rx.seq, FUTEX_WAIT_PRIVATE, seq, &wait, nullptr, 0);
+
+			rx.waiters.fetch_sub(1);
+		}
+	}
+
+	void setLowLatency() {
+#if defined(__linux__)
+		struct serial_struct ser;
+
+		if (ioctl(fd, TIOCGSERIAL, &ser) != 0) {
+			printf("error %d from TIOCGSERIAL\n", errno);
 			return;
 		}
 
-		prevTimeout = 500;
+		ser.flags |= ASYNC_LOW_LATENCY;
 
-		initInterface(speed);
-		setBlocking(false, prevTimeout / 100);
+		if (ioctl(fd, TIOCSSERIAL, &ser) != 0)
+			printf("error %d setting low latency mode\n", errno);
+#endif
+	}
+
+public:
+	SerialPortStream(const char *device, TSpeed speed, uint32_t a_options = OPT_NONE)
+	:
+	options(a_options)
+	{
+		openPort(device, speed);
+	}
+
+	/**
+	 * @param baud Произвольная скорость, бит/с (например, 6000000 для FTDI/CP210x)
+	 */
+	SerialPortStream(const char *device, uint32_t baud, uint32_t a_options = OPT_NONE)
+	:
+	options(a_options)
+	{
+		if (openPort(device, SPEED_115200) == 0)
+			SetSpeed(baud);
+	}
+
+	/**
+	 * Установка произвольной скорости. Перед сменой скорости дожидается
+	 * передачи всех записанных данных.
+	 *
+	 * @return 0 или отрицательный код ошибки
+	 */
+	int SetSpeed(uint32_t baud) final {
+		int res = Drain();
+		if (res < 0)
+			return res;
+
+#if defined(__linux__)
+		struct termios2 tty;
+
+		if (ioctl(fd, TCGETS2, &tty) != 0)
+			return -errno;
+
+		tty.c_cflag &= ~CBAUD;
+		tty.c_cflag |= BOTHER;
+		tty.c_cflag &= ~(CBAUD << IBSHIFT);
+		tty.c_cflag |= BOTHER << IBSHIFT;
+		tty.c_ispeed = baud;
+		tty.c_ospeed = baud;
+
+		if (ioctl(fd, TCSETS2, &tty) != 0)
+			return -errno;
+
+		return 0;
+#else
+		return -ENOTSUP;
+#endif
+	}
+
+	/**
+	 * @return Текущая скорость, бит/с, или 0 при ошибке
+	 */
+	uint32_t GetSpeed() final {
+#if defined(__linux__)
+		struct termios2 tty;
+
+		if (ioctl(fd, TCGETS2, &tty) != 0)
+			return 0;
+
+		return tty.c_ospeed;
+#else
+		return 0;
+#endif
 	}
 
 	~SerialPortStream() {
+		if (rx.thread.joinable()) {
+			rx.stop = true;
+			rx.thread.join();
+		}
+
 		if (fd >= 0)
-			close(fd);
+			Drain();
+	}
+
+	RxStats_t GetRxStats() const {
+		return {rx.received.load(), rx.overruns.load()};
 	}
 
 	int Write(const char *p, size_t len) final {
-		return write(fd, p, len);
+		int res;
+
+		if (!(options & OPT_THROUGHPUT))
+			return writeFd(p, len);
+
+		// Буфер не вмещает данные - передача накопленного.
+		// Если порт принял только часть, принимается столько, сколько помещается.
+		if (tx.len + len > TX_BUFF_SIZE) {
+			if (((res = Flush()) < 0) && (tx.len == TX_BUFF_SIZE))
+				return res;
+		}
+
+		// Крупный блок передаётся напрямую, минуя буфер
+		if ((tx.len == 0) && (len >= TX_BUFF_SIZE))
+			return writeFd(p, len);
+
+		if (len > TX_BUFF_SIZE - tx.len)
+			len = TX_BUFF_SIZE - tx.len;
+
+		memcpy(&tx.buff[tx.len], p, len);
+		tx.len += len;
+		return len;
+	}
+
+	int WriteV(const Fragment_t *frags, size_t n) final {
+		size_t len = 0;
+		int res;
+
+		if (options & OPT_THROUGHPUT) {
+			for (size_t i = 0; i < n; i++)
+				len += frags[i].len;
+
+			if (tx.len + len <= TX_BUFF_SIZE) {
+				for (size_t i = 0; i < n; i++) {
+					memcpy(&tx.buff[tx.len], frags[i].p, frags[i].len);
+					tx.len += frags[i].len;
+				}
+				return len;
+			}
+
+			// Порядок данных: сначала накопленное, затем фрагменты
+			if ((res = Flush()) < 0)
+				return res;
+		}
+
+		return FdStream::WriteV(frags, n);
+	}
+
+	/**
+	 * Передача данных, накопленных в режиме OPT_THROUGHPUT.
+	 *
+	 * При ошибке непереданный остаток сохраняется в буфере.
+	 *
+	 * @return 0 или отрицательный код ошибки
+	 */
+	int Flush() final {
+		size_t done = 0;
+		int res;
+
+		while (done < tx.len) {
+			res = writeFd(&tx.buff[done], tx.len - done);
+
+			if (res <= 0) {
+				memmove(tx.buff, &tx.buff[done], tx.len - done);
+				tx.len -= done;
+				return (res < 0) ? res : -EIO;
+			}
+
+			done += res;
+		}
+
+		tx.len = 0;
+		return 0;
 	}
 
-	int WriteByte(char c) final {
-		return write(fd, &c, 1);
+	// Ожидание фактической передачи всех данных (tcdrain)
+	int Drain() final {
+		int res = Flush();
+		if (res < 0)
+			return res;
+
+		return (tcdrain(fd) == 0) ? 0 : -errno;
 	}
 
-	int ReadByte(char *c, size_t timeoutMs) final {
+	int Read(char *p, size_t len, size_t timeoutMs) final {
+		if (rx.thread.joinable())
+			return ringRead(p, len, timeoutMs);
+
+		if (options & OPT_POLL_TIMEOUT)
+			return pollRead(p, len, timeoutMs);
+
 		if (timeoutMs != prevTimeout) {
 			prevTimeout = timeoutMs;
 			setBlocking(false, prevTimeout / 100);
 		}
 
-		return read(fd, c, 1);
+		return read(fd, p, len);
 	}
 
 };
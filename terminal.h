@@ -5,218 +5,1032 @@
 #include <stdint.h>
 #include <memory.h>
 #include <error.h>
+#include <atomic>
 
 #include "paralstream.h"
+#include "clock.h"
 #include "ansi.h"
+#include "history.h"
 
 
 class Terminal {
 public:
 	static const size_t HISTORY_BUFF_SIZE = 256;
+	static const size_t HISTORY_ENTRIES = 32;
+	static const size_t HISTORY_DEDUP = 4;
+	static const size_t SEARCH_LEN = 32;
+	static const size_t TX_QUEUE_SIZE = 256;
+	static const size_t RX_BUFF_SIZE = 64;
+	static const size_t MAX_FRAGMENTS = 8;
+	static const size_t ASYNC_WAIT_MS = 1000;
+
+	// Поведение при заполненной очереди вывода
+	typedef enum {
+		TX_BLOCK,			// Ожидание передачи (по умолчанию)
+		TX_DROP_OLDEST,		// Отбрасывание самых старых данных очереди
+		TX_FAIL_FAST,		// Отказ в записи новых данных (-ENOBUFS)
+	} TTxPolicy;
+
+	typedef History<HISTORY_ENTRIES, HISTORY_BUFF_SIZE, HISTORY_DEDUP> THistory;
+
+	/**
+	 * Двоичный режим на время существования объекта (передача файлов).
+	 * Допускается вложение.
+	 */
+	class RawMode {
+	public:
+		RawMode(Terminal &a_t)
+		:
+		t(a_t)
+		{
+			t.EnterRaw();
+		}
+
+		~RawMode() {
+			t.LeaveRaw();
+		}
+
+		RawMode(const RawMode &) = delete;
+		RawMode & operator=(const RawMode &) = delete;
+
+	private:
+		Terminal &t;
+	};
 
 public:		// Terminal API
-	Terminal(ParallelStream &a_stream)
+	Terminal(ParallelStream &a_stream, Clock &a_clock = MonotonicClock::Instance())
 	:
-	stream(a_stream)
+	stream(a_stream),
+	clock(a_clock)
 	{
 		term.xpos = 0;
 		term.ypos = 0;
 
-		hist.rPtr = hist.wPtr = hist.buff;
-		*hist.wPtr = '\0';
+		tx.buff = tx.mem[0];
+		tx.head = tx.count = 0;
+		tx.dropped = 0;
+		tx.policy = TX_BLOCK;
+		tx.async = (stream.AsyncDepth() > 0);
+		tx.backBusy = false;
+		tx.backRes = 0;
+		rx.rPos = rx.wPos = 0;
+		edit.active = false;
+		feed.s = nullptr;
+		feed.len = 0;
+		feed.handler = nullptr;
+		feed.ctx = nullptr;
+		store = nullptr;
+		search.active = false;
+		paste.active = false;
+		paste.lines = true;
+		paste.cr = false;
+		raw = 0;
+		crlf = true;
 	}
 
-	void Puts(const char *s) {
-		for (; *s != '\0'; s++)
-			Putc(*s);
+	~Terminal() {
+		Flush();
+
+		// Буфер, переданный асинхронной записи, не освобождается до её завершения
+		while (waitBack() == -EAGAIN);
 	}
 
-	char * Gets(char *s) {
-		char c;
+	int Puts(const char *s) {
+		return Write(s, strlen(s));
+	}
+
+	int Write(const char *p, size_t len) {
+		const ParallelStream::Fragment_t frag = {p, len};
+		return WriteV(&frag, 1);
+	}
+
+	/**
+	 * Вывод сообщения, состоящего из нескольких фрагментов.
+	 *
+	 * Короткие сообщения накапливаются в очереди вывода. Длинные при политике
+	 * TX_BLOCK передаются в поток одним вызовом ParallelStream::WriteV вместе
+	 * с содержимым очереди, без промежуточного копирования.
+	 * При асинхронной записи всё проходит через очередь (двойная буферизация).
+	 * В двоичном режиме фрагменты передаются в поток без копирования в очередь.
+	 *
+	 * @return 0 или отрицательный код ошибки
+	 */
+	int WriteV(const ParallelStream::Fragment_t *frags, size_t n) {
+		ParallelStream::Fragment_t out[MAX_FRAGMENTS + 2];
+		size_t total = 0;
+		size_t first;
+		size_t sent;
 		int res;
 
-		char tmp[32];
-		const char *tmpP;
+		if (raw > 0)
+			return writeRaw(frags, n);
+
+		for (size_t i = 0; i < n; i++)
+			total += frags[i].len;
+
+		if ((n > MAX_FRAGMENTS) || (tx.count + total <= TX_QUEUE_SIZE) || (tx.policy != TX_BLOCK) || tx.async) {
+			for (size_t i = 0; i < n; i++)
+				for (size_t j = 0; j < frags[i].len; j++)
+					if ((res = Putc(frags[i].p[j])) < 0)
+						return res;
+			return 0;
+		}
+
+		// Содержимое очереди (до двух непрерывных участков) + фрагменты
+		first = (tx.count < TX_QUEUE_SIZE - tx.head) ? tx.count : TX_QUEUE_SIZE - tx.head;
+		out[0] = {&tx.buff[tx.head], first};
+		out[1] = {tx.buff, tx.count - first};
+		memcpy(&out[2], frags, n * sizeof(*frags));
+
+		res = writeFragments(out, n + 2);
+
+		// При ошибке непереданный остаток очереди сохраняется
+		sent = tx.count - (out[0].len + out[1].len);
+		tx.head = (tx.head + sent) % TX_QUEUE_SIZE;
+		tx.count -= sent;
+		if (tx.count == 0)
+			tx.head = 0;
+
+		// Положение курсора - по фактически переданному тексту
+		for (size_t i = 0; i < n; i++)
+			for (size_t j = 0; j < frags[i].len - out[i + 2].len; j++)
+				trackCursor(frags[i].p[j]);
+
+		return res;
+	}
 
-		const char *histS = historyGetNewest();
+	/**
+	 * Установка поведения при заполненной очереди вывода
+	 * (например, при остановке передачи RTS/CTS или XOFF).
+	 */
+	void SetTxPolicy(TTxPolicy policy) {
+		tx.policy = policy;
+	}
+
+	// Количество байт, отброшенных или не принятых из-за заполнения очереди вывода
+	size_t GetTxDropped() const {
+		return tx.dropped;
+	}
 
-		size_t pos = 0;
-		size_t size = 0;
+	/**
+	 * Чтение строки с редактированием (блокирующее).
+	 * Ввод сверх len - 1 символов игнорируется.
+	 *
+	 * Ctrl-R / Ctrl-S - поиск по истории (к более старым / новым строкам):
+	 * введённые символы уточняют запрос, повторное нажатие - следующее
+	 * совпадение, Ctrl-G - отмена, другие клавиши принимают найденную строку.
+	 *
+	 * @param len Размер буфера s, включая '\0'
+	 * @return s или nullptr при ошибке потока
+	 */
+	char * Gets(char *s, size_t len) {
+		int res;
+
+		while ((res = GetsStep(s, len, 100)) == 0);
+
+		return (res > 0) ? s : nullptr;
+	}
+
+	/**
+	 * Обработка поступившего ввода строки без ожидания её завершения.
+	 * Состояние редактирования сохраняется между вызовами, s и len
+	 * должны быть одними и теми же до завершения строки.
+	 *
+	 * @param timeoutMs Ожидание ввода (0 - обработка только уже принятых данных)
+	 * @return 1 - строка завершена (Enter), 0 - ввод закончился раньше,
+	 *         отрицательный код ошибки потока
+	 */
+	int GetsStep(char *s, size_t len, uint32_t timeoutMs) {
+		size_t n;
+		int res;
 
 		while (true) {
-			res = Getc();
+			// Вставленный текст - блоками из буфера приёма, без посимвольного декодирования
+			if (paste.active && (rx.rPos < rx.wPos) && !ansiIn.Pending()) {
+				n = ANSI::TextLen(&rx.buff[rx.rPos], rx.wPos - rx.rPos);
+				if (n > 0) {
+					insertText(s, len, &rx.buff[rx.rPos], n);
+					rx.rPos += n;
+					continue;
+				}
+			}
+
+			// Перемещения курсора выводятся, когда принятые данные закончились
+			if ((res = Getc(0)) == -ENODATA) {
+				syncCursor();
+				if (timeoutMs > 0)
+					res = Getc(timeoutMs);
+			}
 
 			if (res == -ENODATA)
-				continue;
+				return 0;
 			else if (res < 0)
-				return nullptr;
+				return res;
+
+			if (editKey(s, len, res))
+				return 1;
+		}
+	}
+
+	/**
+	 * Обработчик завершённой строки ввода (Feed).
+	 * Вызывается из Feed; вывод обработчика передаётся в поток по завершении Feed.
+	 */
+	typedef void (*TLineReady)(void *ctx, char *line);
+
+	/**
+	 * Буфер строки и обработчик завершённых строк для ввода через Feed.
+	 *
+	 * @param len Размер буфера s, включая '\0'
+	 */
+	void SetLineHandler(char *s, size_t len, TLineReady handler, void *ctx) {
+		feed.s = s;
+		feed.len = len;
+		feed.handler = handler;
+		feed.ctx = ctx;
+		edit.active = false;
+	}
 
-			c = (char)res;
+	/**
+	 * Передача принятых байт (из цикла событий, обработчика приёма RTOS):
+	 * декодирование и редактирование строки без ожидания и без чтения потока.
+	 * Для каждой завершённой строки вызывается обработчик SetLineHandler.
+	 * Не совмещается с чтением через Getc/Gets.
+	 *
+	 * @return 0 или отрицательный код ошибки вывода
+	 */
+	int Feed(const char *p, size_t len) {
+		ANSI::TCode code;
+		size_t n;
+		int res;
+
+		for (size_t i = 0; i < len; i++) {
+			if (paste.active && (feed.s != nullptr) && !ansiIn.Pending()
+					&& ((n = ANSI::TextLen(&p[i], len - i)) > 0)) {
+				insertText(feed.s, feed.len, &p[i], n);
+				i += n - 1;
+				continue;
+			}
+
+			code = ansiIn.Decode(p[i]);
+
+			if (code == ANSI::CONTINUE)
+				continue;
+
+			res = (code == ANSI::NONE) ? (unsigned char)p[i] : (int)code;
+
+			if ((feed.s != nullptr) && editKey(feed.s, feed.len, res) && (feed.handler != nullptr))
+				feed.handler(feed.ctx, feed.s);
+		}
+
+		syncCursor();
+
+		res = Flush();
+		return (res < 0) ? res : 0;
+	}
+
+	int Putc(char c) {
+		int res;
+
+		// Очередь заполнена - выгрузка в поток согласно политике
+		if ((tx.count == TX_QUEUE_SIZE) && ((res = makeRoom(1)) < 0))
+			return res;
+
+		tx.buff[(tx.head + tx.count) % TX_QUEUE_SIZE] = c;
+		tx.count++;
+
+		if ((raw == 0) && trackCursor(c))
+			pushTx();
+
+		return 0;
+	}
 
-			// Обработка символа
-			if (res < ANSI::NONE) {
-				Putc(c);
+	/**
+	 * Выгрузка буфера вывода в поток и передача данных,
+	 * накопленных самим потоком (ParallelStream::Flush).
+	 *
+	 * Вызывается автоматически перед ожиданием ввода в Getc.
+	 * Завершения асинхронной записи не ожидает.
+	 *
+	 * @return Количество выгруженных байт или отрицательный код ошибки
+	 */
+	int Flush() {
+		int res = pushTx();
+		int streamRes;
+
+		// Поток не принимает данные - при TX_DROP_OLDEST/TX_FAIL_FAST не ошибка:
+		// остаток ожидает в очереди
+		if ((res == -EAGAIN) && !txBlocking())
+			res = 0;
+
+		if (res < 0)
+			return res;
+
+		streamRes = flushStream();
+		return (streamRes < 0) ? streamRes : res;
+	}
+
+	/**
+	 * Flush + ожидание фактической передачи всех данных потоком.
+	 * Используется по завершении передачи файла и перед сменой скорости.
+	 */
+	int Drain() {
+		int res = pushTx();
+
+		if (res < 0)
+			return res;
+
+		if ((res = stream.Drain()) < 0)
+			return res;
+
+		return waitBack();
+	}
 
-				if (pos < size) {
-					memmove(&s[pos+1], &s[pos], size - pos);
-					s[size+1] = '\0';
+	/**
+	 * Смена скорости канала после передачи всего накопленного вывода.
+	 * Принятые, но не прочитанные данные отбрасываются.
+	 */
+	int SetSpeed(uint32_t baud) {
+		int res = Drain();
+
+		if (res < 0)
+			return res;
+
+		DiscardInput();
+		return stream.SetSpeed(baud);
+	}
+
+	uint32_t GetSpeed() {
+		return stream.GetSpeed();
+	}
 
-					Puts(&s[pos+1]);
+	/**
+	 * Двоичный режим: ввод и вывод без декодирования ANSI и учёта позиции курсора,
+	 * байты ESC, CR, LF и NUL передаются без изменений. Вывод, накопленный
+	 * до входа и до выхода, отправляется в поток.
+	 * Предпочтительно использовать RawMode.
+	 */
+	void EnterRaw() {
+		if (raw++ == 0) {
+			Flush();
+			// Незавершённая последовательность не продолжается двоичными данными
+			ansiIn = ANSI();
+		}
+	}
+
+	void LeaveRaw() {
+		if ((raw > 0) && (--raw == 0))
+			Flush();
+	}
+
+	bool IsRaw() const {
+		return raw > 0;
+	}
+
+	// Поток терминала - для обмена в двоичном режиме в обход очереди вывода
+	ParallelStream & Stream() {
+		return stream;
+	}
+
+	// Часы, по которым отсчитываются таймауты терминала и процессора команд
+	Clock & GetClock() {
+		return clock;
+	}
 
-					sprintf(tmp, "\033[%zuD", size - pos);
-					Puts(tmp);
+	/**
+	 * Терминал на другой стороне требует CR перед LF (по умолчанию).
+	 * Собственный вывод библиотеки всегда содержит "\r\n", настройка
+	 * относится к выводу внешних данных (файлов).
+	 */
+	void SetCrlf(bool a_crlf) {
+		crlf = a_crlf;
+	}
+
+	bool GetCrlf() const {
+		return crlf;
+	}
+
+	/**
+	 * Чтение блока без декодирования ANSI (для двоичного режима):
+	 * данные, уже принятые в буфер, иначе - непосредственно из потока.
+	 *
+	 * @return Количество байт, 0 по истечении timeoutMs или отрицательный код ошибки
+	 */
+	int Read(char *p, size_t len, uint32_t timeoutMs) {
+		size_t n = rx.wPos - rx.rPos;
+
+		if (n > 0) {
+			if (n > len)
+				n = len;
+
+			memcpy(p, &rx.buff[rx.rPos], n);
+			rx.rPos += n;
+			return n;
+		}
+
+		// Вывод должен быть отправлен до ожидания ответа
+		Flush();
+		return stream.Read(p, len, timeoutMs);
+	}
+
+	// Сброс принятых, но не прочитанных данных
+	void DiscardInput() {
+		rx.rPos = rx.wPos = 0;
+		ansiIn = ANSI();
+		paste.active = false;
+	}
+
+	/**
+	 * Обрамление вставленного текста (bracketed paste): терминал передаёт
+	 * вставку между ESC[200~ и ESC[201~, текст вставляется в строку блоками
+	 * с выводом эха одной записью, без обработки каждого символа.
+	 *
+	 * @param lines Перевод строки во вставке завершает строку ввода (строки
+	 *              выполняются как команды по очереди), иначе заменяется пробелом
+	 */
+	int SetBracketedPaste(bool on, bool lines = true) {
+		char tmp[16];
+
+		paste.lines = lines;
+
+		ANSI::Encode(tmp, ANSI::BRACKETED_PASTE, (int)on);
+		return Puts(tmp);
+	}
+
+	int Getc(uint32_t timeoutMs = 100) {
+		uint64_t start;
+		char c;
+		int res;
+		ANSI::TCode code;
+
+		while (1) {
+			// Буфер приёма пуст - пополнение одним чтением
+			if (rx.rPos == rx.wPos) {
+				// Вывод должен быть отправлен до ожидания ответа
+				Flush();
+
+				start = (timeoutMs > 0) ? clock.NowNs() : 0;
+				res = stream.Read(rx.buff, RX_BUFF_SIZE, timeoutMs);
+
+				if (res == 0) {
+					if (timeoutMs > 0)
+						clock.WaitUntilNs(start + timeoutMs * 1000000ull);
+					return -ENODATA;
 				}
+				else if (res < 0)
+					return res;
+
+				rx.rPos = 0;
+				rx.wPos = res;
+			}
+
+			c = rx.buff[rx.rPos++];
+			//printf("In:  \\%03o 0x%02x '%c'\n", (unsigned char)c, (unsigned char)c, (unsigned char)c);
 
-				s[pos] = c;
+			if (raw > 0)
+				return (unsigned char) c;
 
-				size++;
-				pos++;
+			code = ansiIn.Decode(c);
 
+			if (code == ANSI::NONE)
+				return (unsigned char) c;
+			else if (code == ANSI::CONTINUE)
 				continue;
+			else
+				return code;
+		}
+	}
+
+	//void SetAutocomplete(char *table[], size_t n) {
+	//	autocomp = table;
+	//	autocompn = n;
+	//}
+
+private:
+	// Обработка кода клавиши (результата Getc) в редактируемой строке.
+	// Вывод - минимальные изменения строки на экране; перемещения курсора
+	// откладываются до следующего вывода или окончания принятых данных (syncCursor).
+	//
+	// Строка хранится в s как буфер с разрывом: символы до курсора - s[0, pos),
+	// после курсора - s[gapEnd, cap). Вставка, удаление и перемещение курсора
+	// на один символ - без сдвига остатка строки.
+	//
+	// Возвращает true при завершении строки (s - строка с '\0').
+	bool editKey(char *s, size_t len, int res) {
+		beginLine(len);
+
+		// Вставленный текст: табуляция - пробел, перевод строки - пробел
+		// или завершение строки, LF после CR пропускается. Прочие управляющие
+		// символы отбрасываются.
+		if (paste.active) {
+			bool cr = paste.cr;
+
+			paste.cr = (res == ANSI::KEY_RETURN);
+
+			if (cr && (res == ANSI::KEY_NEW_LINE))
+				return false;
+
+			if ((res < (int)ANSI::NONE) && ANSI::IsControl((char)res))
+				return false;
+
+			if ((res == ANSI::KEY_TAB) || (!paste.lines &&
+					((res == ANSI::KEY_NEW_LINE) || (res == ANSI::KEY_RETURN) || (res == ANSI::KEY_END_LINE))))
+				res = ' ';
+		}
+
+		// Поиск: ввод изменяет запрос, прочие клавиши завершают поиск
+		if (search.active && searchKey(s, res))
+			return false;
+
+		size_t &histN = edit.histN;
+		size_t &pos = edit.pos;
+		size_t &size = edit.size;
+		size_t &gapEnd = edit.gapEnd;
+
+		// Обработка символа
+		if (res < ANSI::NONE) {
+			// Разрыв заполнен (место для '\0' зарезервировано)
+			if (pos == gapEnd)
+				return false;
+
+			syncCursor();
+
+			s[pos] = (char)res;
+
+			if (pos < size) {
+				// insert char + char
+				const ParallelStream::Fragment_t ins[] = {
+						{"\033[@", 3},
+						{&s[pos], 1},
+				};
+				WriteV(ins, 2);
 			}
+			else
+				Putc(s[pos]);
 
-			switch (res) {
-				case ANSI::KEY_END_LINE:
-				case ANSI::KEY_NEW_LINE:
-				case ANSI::KEY_RETURN: {
-					s[size] = '\0';
+			size++;
+			pos++;
+			edit.scr = pos;
 
-					historyWriteNewest(s);
-					historySaveNewest();
+			return false;
+		}
 
-					return s;
-				}
+		switch (res) {
+			case ANSI::KEY_END_LINE:
+			case ANSI::KEY_NEW_LINE:
+			case ANSI::KEY_RETURN: {
+				closeGap(s);
 
-				case ANSI::KEY_TAB: {
-					s[size] = '\0';
+				if (store != nullptr) {
+					store->Append(s);
+					// Удаление черновика
+					hist.Write("");
+				}
+				else
+					hist.Push(s);
 
-					/*
-					// Подсчёт совпадений
-					size_t cmpCnt = 0;
-					for (size_t i = 0; i < autocompn; i++)
-						if (strncmp(s, autocomp[i], pos) == 0)
-							cmpCnt++;
+				edit.active = false;
+				return true;
+			}
 
-					// Вывод совпадений при многократном нажатии TAB
-					if ((cmpCnt > 1) && (++tabCnt > 1)) {
+			case ANSI::KEY_TAB: {
+				/*
+				// Подсчёт совпадений
+				size_t cmpCnt = 0;
+				for (size_t i = 0; i < autocompn; i++)
+					if (strncmp(s, autocomp[i], pos) == 0)
+						cmpCnt++;
 
-					}
-					*/
+				// Вывод совпадений при многократном нажатии TAB
+				if ((cmpCnt > 1) && (++tabCnt > 1)) {
 
-					break;
 				}
+				*/
 
-				case ANSI::KEY_BACKSPACE: {
-					if (pos == 0)
-						break;
+				break;
+			}
 
-					if (pos == size) {
-						Puts("\010\033[0K");
-					}
-					else {
-						memmove(&s[pos - 1], &s[pos], size - pos);
-						s[size-1] = '\0';
+			case ANSI::KEY_BACKSPACE: {
+				if (pos == 0)
+					break;
 
-						sprintf(tmp, "\010%s ", &s[pos-1]);	// backspace + text + space
-						Puts(tmp);
+				syncCursor();
 
-						sprintf(tmp, "\033[%zuD", strlen(tmp) - 1); // move left to prev cursor pos
-						Puts(tmp);
-					}
+				// backspace + erase to end of line / delete char
+				Puts((pos == size) ? "\010\033[K" : "\010\033[P");
 
-					size--;
-					pos--;
+				size--;
+				pos--;
+				edit.scr = pos;
+				break;
+			}
+
+			case ANSI::KEY_DEL: {
+				if (pos == size)
 					break;
-				}
 
-				case ANSI::KEY_DEL: {
-					size_t n = size - pos;
+				syncCursor();
+				Puts("\033[P");
 
-					if (pos == size)
-						break;
+				size--;
+				gapEnd++;
+				break;
+			}
 
-					size--;
+			case ANSI::KEY_LEFT: {
+				if (pos > 0)
+					s[--gapEnd] = s[--pos];
+				break;
+			}
+
+			case ANSI::KEY_RIGHT: {
+				if (pos < size)
+					s[pos++] = s[gapEnd++];
+				break;
+			}
 
-					if (n == 1) {
-						Puts(" \010");	// space + backspace
-					} else {
-						memmove(&s[pos], &s[pos + 1], size - pos);
-						s[size] = '\0';
+			case ANSI::KEY_UP: {
+				closeGap(s);
 
-						sprintf(tmp, "%s ", &s[pos]);	// text + space
-						Puts(tmp);
+				// Редактируемая строка сохраняется черновиком истории
+				if (histN == 0)
+					hist.Write(s);
 
-						sprintf(tmp, "\033[%zuD", strlen(tmp)); // move left to prev cursor pos
-						Puts(tmp);
-					}
-					break;
-				}
+				if (historyLine(histN + 1) != nullptr)
+					histN++;
 
-				case ANSI::KEY_LEFT: {
-					if (pos == 0)
-						break;
+				recallLine(s, historyLine(histN));
+				break;
+			}
 
-					pos--;
-					Puts("\033[D");
+			case ANSI::KEY_DOWN: {
+				if (histN == 0)
 					break;
-				}
 
-				case ANSI::KEY_RIGHT: {
-					if (pos == size)
-						break;
+				closeGap(s);
 
-					pos++;
-					Puts("\033[C");
-					break;
-				}
+				histN--;
+				recallLine(s, historyLine(histN));
+				break;
+			}
+
+			case ANSI::KEY_SEARCH_BACK:
+			case ANSI::KEY_SEARCH_FORWARD: {
+				beginSearch(s, res == ANSI::KEY_SEARCH_BACK);
+				break;
+			}
+
+			case ANSI::PASTE_BEGIN: {
+				paste.active = true;
+				paste.cr = false;
+				break;
+			}
 
-				case ANSI::KEY_UP: {
-					s[size] = '\0';
+			case ANSI::PASTE_END: {
+				paste.active = false;
+				break;
+			}
 
-					if (histS == historyGetNewest())
-						historyWriteNewest(s);
+			default:
+				break;
+		}
 
-					histS = historyBack();
-					strcpy(s, histS);
+		return false;
+	}
 
-					if (pos > 0) {
-						sprintf(tmp, "\033[%zuD", pos);
-						Puts(tmp);
-					}
-					sprintf(tmp, "\033[0K%s", s);
-					Puts(tmp);
+	// Начало новой строки
+	void beginLine(size_t len) {
+		if (edit.active)
+			return;
 
-					size = strlen(s);
-					pos = size;
+		edit.active = true;
+		edit.histN = 0;
+		edit.pos = edit.size = edit.scr = 0;
+		edit.cap = edit.gapEnd = len - 1;
+	}
 
-					break;
+	// Вставка блока текста в позицию курсора: копирование в разрыв и эхо
+	// одной записью. Текст сверх вместимости строки отбрасывается.
+	void insertText(char *s, size_t len, const char *p, size_t n) {
+		char ins[24];
+
+		beginLine(len);
+		paste.cr = false;
+
+		if (n > edit.gapEnd - edit.pos)
+			n = edit.gapEnd - edit.pos;
+
+		if (n == 0)
+			return;
+
+		syncCursor();
+
+		memcpy(&s[edit.pos], p, n);
+
+		// insert n chars + text
+		const ParallelStream::Fragment_t echo[] = {
+				{ins, (edit.pos < edit.size) ? (size_t)sprintf(ins, "\033[%zu@", n) : 0},
+				{&s[edit.pos], n},
+		};
+		WriteV(echo, 2);
+
+		edit.pos += n;
+		edit.size += n;
+		edit.scr = edit.pos;
+	}
+
+	// Строка истории по номеру просмотра: 0 - черновик, n - строка n - 1 истории или хранилища
+	const char * historyLine(size_t n) {
+		if (n == 0)
+			return hist.Draft();
+
+		return (store != nullptr) ? store->Get(n - 1) : hist.Get(n - 1);
+	}
+
+	// Перенос разрыва в конец строки: s - непрерывная строка с '\0'.
+	// Позиция редактирования после этого - конец строки.
+	void closeGap(char *s) {
+		memmove(&s[edit.pos], &s[edit.gapEnd], edit.cap - edit.gapEnd);
+		s[edit.size] = '\0';
+
+		edit.pos = edit.size;
+		edit.gapEnd = edit.cap;
+	}
+
+	// Перемещение курсора экрана в позицию редактирования
+	void syncCursor() {
+		// При поиске курсор перемещается сразу
+		if (edit.active && !search.active)
+			moveCursor(edit.pos);
+	}
+
+	// Перемещение курсора экрана в позицию col строки ввода одной последовательностью
+	void moveCursor(size_t col) {
+		char tmp[32];
+		size_t n;
+		char dir;
+
+		if (edit.scr == col)
+			return;
+
+		n = (edit.scr > col) ? edit.scr - col : col - edit.scr;
+		dir = (edit.scr > col) ? 'D' : 'C';
+
+		Write(tmp, (n == 1) ? sprintf(tmp, "\033[%c", dir) : sprintf(tmp, "\033[%zu%c", n, dir));
+		edit.scr = col;
+	}
+
+	// Поиск по истории.
+	// На экране вместо строки ввода: "<метка><запрос>': <строка>", курсор - после запроса.
+	// s - найденная строка (до первого совпадения - исходная), разрыв закрыт.
+	void beginSearch(char *s, bool back) {
+		size_t prev = edit.size;
+
+		closeGap(s);
+
+		// Исходная строка - черновик истории (для отмены)
+		hist.Write(s);
+		edit.histN = 0;
+
+		search.active = true;
+		search.back = back;
+		search.failed = false;
+		search.found = THistory::NOT_FOUND;
+		search.qlen = 0;
+		search.query[0] = '\0';
+
+		drawSearch(s, 0, prev);
+		moveCursor(searchCol());
+	}
+
+	// Клавиша при поиске. false - поиск завершён, клавиша обрабатывается как обычно.
+	bool searchKey(char *s, int res) {
+		switch (res) {
+			case ANSI::KEY_SEARCH_BACK:
+			case ANSI::KEY_SEARCH_FORWARD: {
+				bool back = (res == ANSI::KEY_SEARCH_BACK);
+				size_t found = search.found;
+
+				// Смена направления - вывод метки
+				if (back != search.back) {
+					const char *prev = searchLabel();
+					size_t total = searchLen();
+					size_t common = 0;
+
+					search.back = back;
+					while (prev[common] == searchLabel()[common])
+						common++;
+
+					drawSearch(s, common, total);
 				}
 
-				case ANSI::KEY_DOWN: {
-					s[size] = '\0';
+				// Следующее совпадение
+				if (found == THistory::NOT_FOUND)
+					findMatch(s, back ? 0 : THistory::NOT_FOUND);
+				else
+					findMatch(s, back ? found + 1 : found - 1);
+				break;
+			}
+
+			case ANSI::KEY_BACKSPACE: {
+				if (search.qlen == 0)
+					break;
+
+				moveCursor(searchCol());
+				Puts("\010\033[P");
+				edit.scr--;
 
-					histS = historyForward();
-					strcpy(s, histS);
+				search.query[--search.qlen] = '\0';
 
-					if (pos > 0) {
-						sprintf(tmp, "\033[%zuD", pos);
-						Puts(tmp);
-					}
-					sprintf(tmp, "\033[0K%s", s);
-					Puts(tmp);
+				if (search.found == THistory::NOT_FOUND)
+					search.failed = (search.qlen > 0);
+				else
+					search.failed = (strstr(s, search.query) == nullptr);
+				break;
+			}
+
+			case ANSI::KEY_CANCEL: {
+				endSearch(s, (search.found == THistory::NOT_FOUND) ? THistory::NOT_FOUND : 0);
+				break;
+			}
 
-					size = strlen(s);
-					pos = size;
+			default: {
+				if (res >= (int)ANSI::NONE) {
+					endSearch(s, (search.found == THistory::NOT_FOUND) ? THistory::NOT_FOUND : search.found + 1);
+					return false;
 				}
 
-				default:
+				if (search.qlen + 1 >= SEARCH_LEN)
 					break;
+
+				// insert char + char
+				const char c = (char)res;
+				const ParallelStream::Fragment_t ins[] = {
+						{"\033[@", 3},
+						{&c, 1},
+				};
+
+				moveCursor(searchCol());
+				WriteV(ins, 2);
+				edit.scr++;
+
+				search.query[search.qlen++] = c;
+				search.query[search.qlen] = '\0';
+
+				// Более длинный запрос - только среди строк не новее текущей
+				if (search.failed)
+					Putc('\007');
+				else if ((search.found == THistory::NOT_FOUND) || (strstr(s, search.query) == nullptr))
+					search.failed = !findMatch(s, (search.found != THistory::NOT_FOUND) ? search.found :
+							(search.back ? 0 : THistory::NOT_FOUND));
+				break;
+			}
+		}
+
+		moveCursor(searchCol());
+		return true;
+	}
+
+	// Поиск запроса от строки истории n; при неудаче - звуковой сигнал
+	bool findMatch(char *s, size_t n) {
+		size_t total = searchLen();
+		size_t common = 0;
+		const char *src;
+
+		if (n != THistory::NOT_FOUND)
+			n = (store != nullptr) ? store->Find(search.query, n, search.back) : hist.Find(search.query, n, search.back);
+
+		if (n == THistory::NOT_FOUND) {
+			Putc('\007');
+			return false;
+		}
+
+		// Вывод найденной строки после общего с прежней начала
+		src = historyLine(n + 1);
+		while ((common < edit.size) && (s[common] == src[common]))
+			common++;
+
+		edit.size = copyLine(s, src, edit.cap + 1);
+		if (common > edit.size)
+			common = edit.size;
+
+		search.found = n;
+		drawSearch(s, searchCol() + 3 + common, total);
+		return true;
+	}
+
+	// Завершение поиска: строка ввода - строка истории n (0 - черновик)
+	// или s без изменений (NOT_FOUND)
+	void endSearch(char *s, size_t n) {
+		size_t total = searchLen();
+
+		search.active = false;
+
+		if (n != THistory::NOT_FOUND) {
+			edit.histN = n;
+			edit.size = copyLine(s, historyLine(n), edit.cap + 1);
+		}
+		edit.pos = edit.size;
+
+		moveCursor(0);
+
+		// text + erase to end of line
+		const ParallelStream::Fragment_t redraw[] = {
+				{s, edit.size},
+				{"\033[K", (edit.size < total) ? (size_t)3 : 0},
+		};
+		WriteV(redraw, 2);
+
+		edit.scr = edit.size;
+	}
+
+	// Вывод строки поиска с позиции col; prev - прежняя длина строки на экране
+	void drawSearch(const char *s, size_t col, size_t prev) {
+		const char *label = searchLabel();
+		const ParallelStream::Fragment_t parts[] = {
+				{label, strlen(label)},
+				{search.query, search.qlen},
+				{"': ", 3},
+				{s, edit.size},
+		};
+		ParallelStream::Fragment_t out[5];
+		size_t skip = col;
+		size_t n = 0;
+
+		for (const auto &part : parts) {
+			if (skip >= part.len) {
+				skip -= part.len;
+				continue;
 			}
+
+			out[n++] = {part.p + skip, part.len - skip};
+			skip = 0;
 		}
+
+		// erase to end of line
+		out[n++] = {"\033[K", (searchLen() < prev) ? (size_t)3 : 0};
+
+		moveCursor(col);
+		WriteV(out, n);
+		edit.scr = searchLen();
+	}
+
+	const char * searchLabel() const {
+		return search.back ? "(reverse-i-search)`" : "(i-search)`";
+	}
+
+	// Позиция курсора - после запроса
+	size_t searchCol() const {
+		return strlen(searchLabel()) + search.qlen;
 	}
 
-	void Putc(char c) {
-		stream.WriteByte(c);
+	size_t searchLen() const {
+		return searchCol() + 3 + edit.size;
+	}
+
+	// Замена строки ввода (после closeGap) строкой истории: выводится только
+	// часть после общего со строкой на экране начала
+	void recallLine(char *s, const char *src) {
+		size_t prev = edit.size;
+		size_t common = 0;
+
+		while ((common < prev) && (s[common] == src[common]))
+			common++;
+
+		edit.size = copyLine(s, src, edit.cap + 1);
+		if (common > edit.size)
+			common = edit.size;
+
+		edit.pos = common;
+		syncCursor();
+
+		// text + erase to end of line
+		const ParallelStream::Fragment_t redraw[] = {
+				{&s[common], edit.size - common},
+				{"\033[K", (edit.size < prev) ? (size_t)3 : 0},
+		};
+		WriteV(redraw, 2);
+
+		edit.pos = edit.scr = edit.size;
+	}
+
+	// Копирование строки истории с усечением до размера буфера
+	static size_t copyLine(char *s, const char *src, size_t len) {
+		size_t n = strlen(src);
+
+		if (n >= len)
+			n = len - 1;
+
+		memcpy(s, src, n);
+		s[n] = '\0';
+
+		return n;
+	}
+
+	// Отслеживание позиции курсора по выводимым символам.
+	// Возвращает true при переводе строки.
+	bool trackCursor(char c) {
+		bool newLine = false;
 
 		switch (ansiOut.Decode(c)) {
 			case ANSI::KEY_END_LINE:
@@ -224,6 +1038,7 @@ public:		// Terminal API
 
 			case ANSI::KEY_NEW_LINE:
 				term.ypos++;
+				newLine = true;
 				break;
 
 			case ANSI::KEY_RETURN:
@@ -260,114 +1075,268 @@ public:		// Terminal API
 
 		if (term.xpos < 0) term.xpos = 0;
 		if (term.ypos < 0) term.ypos = 0;
+
+		return newLine;
 	}
 
-	int Getc(uint32_t timeoutMs = 100) {
-		char c;
+	// Запись в поток с ожиданием его готовности: политика TX_BLOCK и двоичный режим.
+	// Иначе поток не ожидает (SetWriteTimeout(0)), а не принятое отбрасывается
+	// политикой при заполнении очереди - вывод не задерживает обработку ввода.
+	bool txBlocking() const {
+		return (tx.policy == TX_BLOCK) || (raw > 0);
+	}
+
+	// Выгрузка очереди вывода в поток одной операцией записи.
+	// Выполняется при переводе строки и заполнении очереди.
+	// Не принятый потоком остаток сохраняется в очереди.
+	int pushTx() {
+		size_t timeout;
 		int res;
-		ANSI::TCode code;
 
-		while (1) {
-			res = stream.ReadByte(&c, timeoutMs);
-			//if (res == 1) printf("In:  \\%03o 0x%02x '%c'\n", (unsigned char)c, (unsigned char)c, (unsigned char)c);
+		if (tx.async)
+			return pushTxAsync();
 
-			if (res == 0) {
-				return -ENODATA;
+		if (txBlocking())
+			return pushTxSync();
 
-			} else if (res == 1) {
-				code = ansiIn.Decode(c);
+		timeout = stream.SetWriteTimeout(0);
+		res = pushTxSync();
+		stream.SetWriteTimeout(timeout);
 
-				if (code == ANSI::NONE)
-					return (unsigned char) c;
-				else if (code == ANSI::CONTINUE)
-					continue;
-				else
-					return code;
+		return res;
+	}
 
-			} else {
-				return res;
-			}
+	// Передача данных, накопленных потоком, без ожидания при !txBlocking()
+	int flushStream() {
+		size_t timeout;
+		int res;
+
+		if (txBlocking())
+			return stream.Flush();
+
+		timeout = stream.SetWriteTimeout(0);
+		res = stream.Flush();
+		stream.SetWriteTimeout(timeout);
+
+		return (res == -EAGAIN) ? 0 : res;
+	}
+
+	int pushTxSync() {
+		size_t done = 0;
+		size_t first;
+		int res;
+
+		while (tx.count > 0) {
+			first = (tx.count < TX_QUEUE_SIZE - tx.head) ? tx.count : TX_QUEUE_SIZE - tx.head;
+
+			const ParallelStream::Fragment_t seg[] = {
+					{&tx.buff[tx.head], first},
+					{tx.buff, tx.count - first},
+			};
+			res = stream.WriteV(seg, (tx.count > first) ? 2 : 1);
+
+			if (res <= 0)
+				return (res < 0) ? res : -EIO;
+
+			tx.head = (tx.head + res) % TX_QUEUE_SIZE;
+			tx.count -= res;
+			done += res;
 		}
+
+		tx.head = 0;
+		return done;
 	}
 
-	//void SetAutocomplete(char *table[], size_t n) {
-	//	autocomp = table;
-	//	autocompn = n;
-	//}
+	// Передача очереди вывода асинхронной записью. Пока передаётся один буфер,
+	// вывод накапливается во втором.
+	int pushTxAsync() {
+		char *back = (tx.buff == tx.mem[0]) ? tx.mem[1] : tx.mem[0];
+		size_t len = tx.count;
+		size_t first;
+		const char *p;
+		int res;
 
-private:
-public:
-	void historyWriteNewest(const char *s) {
-		size_t len = strlen(s) + 1; // len + '\0'
+		if (len == 0)
+			return 0;
 
-		// (Длина == 1) ИЛИ (Новая строка == Текущая строка)
-		if ((len == 1) || (strcmp(s, hist.wPtr) == 0))
-			// Игнорирование
-			return;
+		// Без ожидания при !txBlocking(): -EAGAIN - очередь обрабатывается политикой
+		if ((res = waitBack(txBlocking() ? ASYNC_WAIT_MS : 0)) < 0)
+			return res;
+
+		first = (len < TX_QUEUE_SIZE - tx.head) ? len : TX_QUEUE_SIZE - tx.head;
 
-		size_t free = &hist.buff[HISTORY_BUFF_SIZE] - hist.wPtr;
-		size_t usage = HISTORY_BUFF_SIZE - free;
-		size_t removeLen = 0;
-		// Удаление первых элементов буфера, если не достаточно места для сохранения строки
-		while (len > (free + removeLen)) {
-			removeLen += strlen(&hist.buff[removeLen]) + 1; // len + '\0'
+		// Непрерывные данные передаются без копирования, иначе собираются во втором буфере
+		if (first == len)
+			p = &tx.buff[tx.head];
+		else {
+			memcpy(back, &tx.buff[tx.head], first);
+			memcpy(&back[first], tx.buff, len - first);
+			p = back;
 		}
-		usage -= removeLen;
-		memmove(hist.buff, &hist.buff[removeLen], usage);
 
-		hist.rPtr = hist.wPtr = &hist.buff[usage];
-		strcpy(hist.wPtr, s);
+		tx.backBusy.store(true, std::memory_order_relaxed);
+
+		res = stream.WriteAsync(p, len, onWriteDone, this);
+		if (res < 0) {
+			tx.backBusy.store(false, std::memory_order_relaxed);
+			return (res == -EBUSY) ? -EAGAIN : res;
+		}
+
+		// Передаваемый буфер становится задним, вывод продолжается в другой
+		if (p != back)
+			tx.buff = back;
+
+		tx.head = tx.count = 0;
+		return len;
 	}
 
-	void historySaveNewest() {
-		size_t len = strlen(hist.wPtr) + 1; // len + '\0'
+	// Ожидание завершения асинхронной записи заднего буфера.
+	// Возвращает -EAGAIN, если запись не завершилась за timeoutMs.
+	int waitBack(size_t timeoutMs = ASYNC_WAIT_MS) {
+		int res;
 
-		if (len == 1)
-			return;
+		while (tx.backBusy.load(std::memory_order_acquire)) {
+			res = stream.WaitAsync(0, timeoutMs);
+			if (res < 0)
+				return (res == -ETIMEDOUT) ? -EAGAIN : res;
+		}
 
-		hist.rPtr = hist.wPtr += len;
-		*hist.wPtr = '\0';
+		res = tx.backRes.exchange(0);
+		return (res < 0) ? res : 0;
 	}
 
-	const char * historyGetNewest() const {
-		return hist.wPtr;
+	static void onWriteDone(void *ctx, int res) {
+		Terminal *t = (Terminal *)ctx;
+
+		if (res < 0)
+			t->tx.backRes.store(res, std::memory_order_relaxed);
+		t->tx.backBusy.store(false, std::memory_order_release);
 	}
 
-	const char * historyBack() {
-		const char *ret = nullptr;
+	// Освобождение места в очереди вывода согласно политике
+	int makeRoom(size_t n) {
+		size_t drop;
+		int res = pushTx();
+
+		while (TX_QUEUE_SIZE - tx.count < n) {
+			switch (tx.policy) {
+				case TX_BLOCK:
+					// Поток временно не принимает данные - повтор
+					if ((res < 0) && (res != -EAGAIN))
+						return res;
+					res = pushTx();
+					break;
 
-		//if (histn.rPtr <= histn.wPtr) {
-			// Переход к предыдущей строке
-			if (hist.rPtr > hist.buff) { hist.rPtr--; }
-			while ((hist.rPtr > hist.buff) && (*(hist.rPtr - 1) != '\0')) { hist.rPtr--; }
-			// for (; (histn.rPtr > histn.buff) && (*histn.rPtr != '\0'); histn.rPtr--);
+				case TX_DROP_OLDEST:
+					drop = n - (TX_QUEUE_SIZE - tx.count);
+					tx.head = (tx.head + drop) % TX_QUEUE_SIZE;
+					tx.count -= drop;
+					tx.dropped += drop;
+					break;
 
-			ret = hist.rPtr;
-		//}
+				case TX_FAIL_FAST:
+					tx.dropped += n;
+					return -ENOBUFS;
+			}
+		}
 
-		return ret;
+		return 0;
 	}
 
-	const char * historyForward() {
-		const char *ret;
+	// Запись в двоичном режиме: очередь вывода, затем фрагменты непосредственно в поток.
+	// Асинхронная запись заднего буфера завершается до синхронной записи.
+	int writeRaw(const ParallelStream::Fragment_t *frags, size_t n) {
+		ParallelStream::Fragment_t rest;
+		size_t done;
+		int res;
 
-		if (hist.rPtr < hist.wPtr) {
-			hist.rPtr++;
+		while (tx.count > 0)
+			if (((res = pushTx()) < 0) && (res != -EAGAIN))
+				return res;
 
-			// Переход к следующей строке
-			while ((hist.rPtr <= hist.wPtr) && (*(hist.rPtr - 1) != '\0')) { hist.rPtr++; }
+		if ((res = waitBack()) < 0)
+			return res;
 
-			ret = hist.rPtr;
+		while (n > 0) {
+			res = stream.WriteV(frags, n);
+			if (res == -EAGAIN)
+				continue;
+			else if (res <= 0)
+				return (res < 0) ? res : -EIO;
+
+			// Пропуск записанных фрагментов
+			done = res;
+			while ((n > 0) && (done >= frags->len)) {
+				done -= frags->len;
+				frags++;
+				n--;
+			}
+
+			// Остаток частично записанного фрагмента
+			if ((n > 0) && (done > 0)) {
+				rest = {frags->p + done, frags->len - done};
+				if ((res = writeFragments(&rest, 1)) < 0)
+					return res;
+
+				frags++;
+				n--;
+			}
 		}
-		else
-			ret = hist.wPtr;
 
-		return ret;
+		return 0;
+	}
+
+	// Запись фрагментов целиком, с повтором при частичной записи.
+	// Длины фрагментов уменьшаются на переданное: при ошибке в них - непереданный остаток.
+	int writeFragments(ParallelStream::Fragment_t *frags, size_t n) {
+		size_t done;
+		int res;
+
+		while (n > 0) {
+			res = stream.WriteV(frags, n);
+			if (res == -EAGAIN)
+				continue;
+			else if (res <= 0)
+				return (res < 0) ? res : -EIO;
+
+			// Пропуск записанных фрагментов
+			done = res;
+			while ((n > 0) && (done >= frags->len)) {
+				done -= frags->len;
+				frags->len = 0;
+				frags++;
+				n--;
+			}
+
+			if (n > 0) {
+				frags->p += done;
+				frags->len -= done;
+			}
+		}
+
+		return 0;
+	}
+
+
+public:
+	// История введённых строк
+	THistory & GetHistory() {
+		return hist;
+	}
+
+	/**
+	 * Внешнее хранилище истории: сохранение введённых строк, просмотр и поиск
+	 * выполняются в нём. Встроенная история хранит только черновик.
+	 * nullptr - встроенная история.
+	 */
+	void SetHistoryStore(HistoryStore *a_store) {
+		store = a_store;
 	}
 
 
 private:
 	ParallelStream &stream;
+	Clock &clock;
 
 	ANSI ansiIn;
 	ANSI ansiOut;
@@ -377,12 +1346,68 @@ private:
 		int ypos;
 	} term;
 
+	THistory hist;
+	HistoryStore *store;
+
+	struct {
+		char mem[2][TX_QUEUE_SIZE];
+		char *buff;				// Очередь вывода - один из буферов mem
+		size_t head;
+		size_t count;
+
+		size_t dropped;
+		TTxPolicy policy;
+
+		// Асинхронная запись: второй буфер mem передаётся потоком
+		bool async;
+		std::atomic<bool> backBusy;
+		std::atomic<int> backRes;
+	} tx;
+
+	struct {
+		char buff[RX_BUFF_SIZE];
+		size_t rPos;
+		size_t wPos;
+	} rx;
+
+	// Состояние редактирования незавершённой строки (GetsStep)
+	struct {
+		bool active;
+		size_t histN;			// Строка истории на экране: 0 - черновик, n - Get(n - 1)
+		size_t pos;				// Курсор = начало разрыва
+		size_t gapEnd;			// Конец разрыва
+		size_t size;			// Длина строки
+		size_t cap;				// Вместимость строки (размер буфера - 1)
+		size_t scr;				// Позиция курсора на экране
+	} edit;
+
+	// Ввод через Feed
+	struct {
+		char *s;
+		size_t len;
+		TLineReady handler;
+		void *ctx;
+	} feed;
+
+	// Поиск по истории (Ctrl-R / Ctrl-S)
+	struct {
+		bool active;
+		bool back;				// К более старым строкам
+		bool failed;			// Запрос не найден
+		size_t found;			// Номер найденной строки истории или NOT_FOUND
+		char query[SEARCH_LEN];
+		size_t qlen;
+	} search;
+
+	// Вставка текста (bracketed paste)
 	struct {
-		char buff[HISTORY_BUFF_SIZE];
+		bool active;		// Принимается текст между ESC[200~ и ESC[201~
+		bool lines;			// Перевод строки завершает строку ввода
+		bool cr;			// Последний символ вставки - CR
+	} paste;
 
-		char *wPtr;
-		const char *rPtr;
-	} hist;
+	size_t raw;				// Глубина вложения двоичного режима
+	bool crlf;
 
 	//char **autocomp;
 	//size_t autocompn;